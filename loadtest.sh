@@ -0,0 +1,80 @@
+#!/usr/bin/env bash
+# End to end load test: runs ambiencesvc against a local ambiencesvc-standin
+# serving fixtures, then prints slide latency distributions from the trace ring.
+# See fixtures/README.md for the layout of the fixtures directory.
+#
+# The service runs with config.json, minus anything that could touch the real
+# display stack: images go to a private shm, no renderer is signalled, no memfd
+# socket or slide recording is opened, and the eInk display is mocked.
+#
+# Usage: ./loadtest.sh fixtures_dir [duration_sec] [standin args...]
+#   eg ./loadtest.sh ./fixtures 300 -l 200 -j 100 -b 256 -e 5
+# Needs `make ambiencesvc ambiencesvc-trace ambiencesvc-standin` first.
+
+set -euo pipefail
+
+if [ $# -lt 1 ]; then
+  echo "Usage: $0 fixtures_dir [duration_sec] [standin args...]" >&2
+  exit 1
+fi
+
+FIXTURES="$1"
+DURATION="${2:-120}"
+shift $(( $# < 2 ? $# : 2 ))
+
+PORT="${LOADTEST_PORT:-5077}"
+TRACE_SHM="ambience_loadtest_trace"
+IMG_SHM="ambience_loadtest_img"
+CFG="$(mktemp /tmp/ambience_loadtest.XXXXXX.json)"
+STANDIN_PID=""
+
+cleanup() {
+  [ -n "$STANDIN_PID" ] && kill "$STANDIN_PID" 2>/dev/null || true
+  rm -f "$CFG" "/dev/shm/$IMG_SHM" "/dev/shm/${IMG_SHM}_ctl"
+}
+trap cleanup EXIT
+
+if [ ! -d "$FIXTURES" ]; then
+  echo "$FIXTURES isn't a directory, see fixtures/README.md" >&2
+  exit 1
+fi
+
+./ambiencesvc-standin -d "$FIXTURES" -p "$PORT" "$@" &
+STANDIN_PID=$!
+sleep 1
+
+# Point the service at the stand-in, trace to a private ring and fetch as often
+# as the service allows. Keys are disabled with the XX prefix, like in
+# config.json; disabling "outputs" leaves a single output, configured by the
+# top level shm_image_file_name.
+sed -e "s|\"www_svc_url\": *\"[^\"]*\"|\"www_svc_url\": \"http://127.0.0.1:$PORT\"|" \
+    -e "s|\"trace_shm_file_name\": *\"[^\"]*\"|\"trace_shm_file_name\": \"$TRACE_SHM\"|" \
+    -e "s|\"slideshow_sleep_time_sec\": *[0-9]*|\"slideshow_sleep_time_sec\": 5|" \
+    -e "s|\"shm_image_file_name\": *\"[^\"]*\"|\"shm_image_file_name\": \"$IMG_SHM\"|g" \
+    -e "s|\"shm_leak_file\": *[a-z]*|\"shm_leak_file\": false|" \
+    -e "s|\"eink_mock_display\": *[a-z]*|\"eink_mock_display\": true|" \
+    -e "s/\"\(outputs\|image_render_proc_name\|memfd_socket_path\|record_slides_path\)\" *:/\"XX\1\":/g" \
+    config.json > "$CFG"
+
+# Refuse to run if config.json changed in a way the overrides above missed
+for want in "\"shm_image_file_name\": \"$IMG_SHM\"" \
+            "\"trace_shm_file_name\": \"$TRACE_SHM\"" \
+            '"eink_mock_display": true'; do
+  if ! grep -q "$want" "$CFG"; then
+    echo "Can't override $want in config.json, not running" >&2
+    exit 1
+  fi
+done
+if grep -q '"\(outputs\|image_render_proc_name\|memfd_socket_path\|record_slides_path\)" *:' "$CFG"; then
+  echo "Can't disable outputs or renderers in config.json, not running" >&2
+  exit 1
+fi
+
+echo "Running ambiencesvc against stand-in for ${DURATION}s..."
+./ambiencesvc "$CFG" &
+SVC_PID=$!
+sleep "$DURATION"
+kill -INT "$SVC_PID"
+wait "$SVC_PID" || true
+
+./ambiencesvc-trace "$TRACE_SHM" -s
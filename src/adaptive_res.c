@@ -0,0 +1,122 @@
+#include "adaptive_res.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Shrink by 20% when over budget, grow back by 10% when well under budget
+#define SHRINK_PCT 80
+#define GROW_PCT 110
+// Only grow if latency was under this % of the budget for GROW_AFTER_N slides
+#define GROW_HEADROOM_PCT 50
+#define GROW_AFTER_N_SLIDES 5
+// The first slide after a change may need a new registration, don't judge it
+#define SKIP_SLIDES_AFTER_CHANGE 1
+
+struct AdaptiveRes {
+  size_t width;
+  size_t height;
+  size_t min_width;
+  size_t min_height;
+  size_t max_width;
+  size_t max_height;
+  size_t latency_budget_ms;
+  size_t slides_under_budget;
+  size_t slides_to_skip;
+};
+
+static size_t clamp(size_t v, size_t min, size_t max) {
+  return v < min ? min : v > max ? max : v;
+}
+
+struct AdaptiveRes *adaptive_res_init(size_t width, size_t height,
+                                      size_t min_width, size_t min_height,
+                                      size_t max_width, size_t max_height,
+                                      size_t latency_budget_ms) {
+  if ((min_width > max_width) || (min_height > max_height)) {
+    fprintf(stderr, "adaptive_res: invalid bounds %zux%zu - %zux%zu\n",
+            min_width, min_height, max_width, max_height);
+    return NULL;
+  }
+
+  struct AdaptiveRes *h = malloc(sizeof(struct AdaptiveRes));
+  if (!h) {
+    perror("adaptive_res: bad alloc");
+    return NULL;
+  }
+
+  h->min_width = min_width;
+  h->min_height = min_height;
+  h->max_width = max_width;
+  h->max_height = max_height;
+  h->width = clamp(width, min_width, max_width);
+  h->height = clamp(height, min_height, max_height);
+  h->latency_budget_ms = latency_budget_ms;
+  h->slides_under_budget = 0;
+  h->slides_to_skip = 0;
+  return h;
+}
+
+void adaptive_res_free(struct AdaptiveRes *h) { free(h); }
+
+static bool adaptive_res_scale(struct AdaptiveRes *h, size_t pct,
+                               const char *reason, size_t latency_ms) {
+  // Scale both dimensions by the same factor, stopping as soon as either of
+  // them reaches its bound, so the aspect ratio is kept
+  double scale = pct / 100.0;
+  if (scale < 1) {
+    scale = fmax(scale, (double)h->min_width / h->width);
+    scale = fmin(fmax(scale, (double)h->min_height / h->height), 1);
+  } else {
+    scale = fmin(scale, (double)h->max_width / h->width);
+    scale = fmax(fmin(scale, (double)h->max_height / h->height), 1);
+  }
+  const size_t w =
+      clamp(h->width * scale + 0.5, h->min_width, h->max_width);
+  const size_t ht =
+      clamp(h->height * scale + 0.5, h->min_height, h->max_height);
+  if ((w == h->width) && (ht == h->height)) {
+    // Already at the bounds, nothing to do
+    return false;
+  }
+
+  printf("Adaptive resolution: %zux%zu -> %zux%zu, %s (latency %zu ms, "
+         "budget %zu ms)\n",
+         h->width, h->height, w, ht, reason, latency_ms, h->latency_budget_ms);
+  h->width = w;
+  h->height = ht;
+  h->slides_under_budget = 0;
+  h->slides_to_skip = SKIP_SLIDES_AFTER_CHANGE;
+  return true;
+}
+
+bool adaptive_res_on_slide(struct AdaptiveRes *h, size_t latency_ms) {
+  if (h->slides_to_skip > 0) {
+    h->slides_to_skip--;
+    return false;
+  }
+
+  if (latency_ms > h->latency_budget_ms) {
+    h->slides_under_budget = 0;
+    return adaptive_res_scale(h, SHRINK_PCT, "slide over latency budget",
+                              latency_ms);
+  }
+
+  if (latency_ms * 100 > h->latency_budget_ms * GROW_HEADROOM_PCT) {
+    // Within budget but without much headroom: stay here
+    h->slides_under_budget = 0;
+    return false;
+  }
+
+  if (++h->slides_under_budget < GROW_AFTER_N_SLIDES) {
+    return false;
+  }
+
+  return adaptive_res_scale(h, GROW_PCT, "latency well under budget",
+                            latency_ms);
+}
+
+void adaptive_res_get(struct AdaptiveRes *h, size_t *width, size_t *height) {
+  *width = h->width;
+  *height = h->height;
+}
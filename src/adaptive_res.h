@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Picks the image size to request from the image service, so that the
+// fetch+publish latency of each slide stays within a budget. Shrinks the
+// requested size as soon as a slide is over budget, and grows it back slowly
+// when there is plenty of headroom.
+struct AdaptiveRes;
+
+struct AdaptiveRes *adaptive_res_init(size_t width, size_t height,
+                                      size_t min_width, size_t min_height,
+                                      size_t max_width, size_t max_height,
+                                      size_t latency_budget_ms);
+void adaptive_res_free(struct AdaptiveRes *h);
+
+// Record the latency of the last slide. Returns true if the target resolution
+// changed (and logs the new resolution and the reason for the change)
+bool adaptive_res_on_slide(struct AdaptiveRes *h, size_t latency_ms);
+
+// Current target resolution
+void adaptive_res_get(struct AdaptiveRes *h, size_t *width, size_t *height);
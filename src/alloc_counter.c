@@ -0,0 +1,136 @@
+#include "alloc_counter.h"
+
+#ifdef ALLOC_COUNTER
+
+#include <errno.h>
+#include <malloc.h>
+#include <stdatomic.h>
+
+// glibc's allocator entry points; our malloc replacements forward to these
+extern void *__libc_malloc(size_t sz);
+extern void *__libc_calloc(size_t n, size_t sz);
+extern void *__libc_realloc(void *ptr, size_t sz);
+extern void __libc_free(void *ptr);
+extern void *__libc_memalign(size_t align, size_t sz);
+extern void *__libc_valloc(size_t sz);
+extern void *__libc_pvalloc(size_t sz);
+
+static atomic_size_t g_owned_allocs = 0;
+static atomic_size_t g_lib_allocs = 0;
+static atomic_size_t g_bytes = 0;
+static atomic_size_t g_live_bytes = 0;
+static atomic_size_t g_peak_live_bytes = 0;
+static __thread size_t t_lib_depth = 0;
+
+static void alloc_counter_count(size_t sz) {
+  if (t_lib_depth > 0) {
+    atomic_fetch_add_explicit(&g_lib_allocs, 1, memory_order_relaxed);
+  } else {
+    atomic_fetch_add_explicit(&g_owned_allocs, 1, memory_order_relaxed);
+  }
+  atomic_fetch_add_explicit(&g_bytes, sz, memory_order_relaxed);
+}
+
+static void *alloc_counter_track(void *ptr) {
+  if (!ptr) {
+    return NULL;
+  }
+
+  const size_t sz = malloc_usable_size(ptr);
+  const size_t live =
+      atomic_fetch_add_explicit(&g_live_bytes, sz, memory_order_relaxed) + sz;
+  size_t peak = atomic_load_explicit(&g_peak_live_bytes, memory_order_relaxed);
+  while ((live > peak) && !atomic_compare_exchange_weak_explicit(
+                              &g_peak_live_bytes, &peak, live,
+                              memory_order_relaxed, memory_order_relaxed)) {
+  }
+  return ptr;
+}
+
+// Saturates at zero: glibc may still hand out blocks that didn't go through
+// our allocators (eg allocated before they were interposed), and freeing one
+// must not wrap live bytes around
+static void alloc_counter_untrack(size_t usable_sz) {
+  size_t live = atomic_load_explicit(&g_live_bytes, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(
+      &g_live_bytes, &live, live > usable_sz ? live - usable_sz : 0,
+      memory_order_relaxed, memory_order_relaxed)) {
+  }
+}
+
+void *malloc(size_t sz) {
+  alloc_counter_count(sz);
+  return alloc_counter_track(__libc_malloc(sz));
+}
+
+void *calloc(size_t n, size_t sz) {
+  alloc_counter_count(n * sz);
+  return alloc_counter_track(__libc_calloc(n, sz));
+}
+
+void *realloc(void *ptr, size_t sz) {
+  alloc_counter_count(sz);
+  const size_t old_sz = ptr ? malloc_usable_size(ptr) : 0;
+  void *new_ptr = __libc_realloc(ptr, sz);
+  // On failure the old block is left untouched
+  if (new_ptr || !sz) {
+    alloc_counter_untrack(old_sz);
+  }
+  return alloc_counter_track(new_ptr);
+}
+
+// Aligned allocations are freed with free too, so they need to be tracked for
+// live bytes to add up
+void *memalign(size_t align, size_t sz) {
+  alloc_counter_count(sz);
+  return alloc_counter_track(__libc_memalign(align, sz));
+}
+
+void *aligned_alloc(size_t align, size_t sz) { return memalign(align, sz); }
+
+void *valloc(size_t sz) {
+  alloc_counter_count(sz);
+  return alloc_counter_track(__libc_valloc(sz));
+}
+
+void *pvalloc(size_t sz) {
+  alloc_counter_count(sz);
+  return alloc_counter_track(__libc_pvalloc(sz));
+}
+
+int posix_memalign(void **out, size_t align, size_t sz) {
+  if ((align < sizeof(void *)) || (align & (align - 1))) {
+    return EINVAL;
+  }
+  void *ptr = memalign(align, sz);
+  if (!ptr) {
+    return ENOMEM;
+  }
+  *out = ptr;
+  return 0;
+}
+
+void free(void *ptr) {
+  if (ptr) {
+    alloc_counter_untrack(malloc_usable_size(ptr));
+  }
+  __libc_free(ptr);
+}
+
+bool alloc_counter_enabled(void) { return true; }
+
+void alloc_counter_get(struct AllocCounters *out) {
+  out->owned_allocs = g_owned_allocs;
+  out->lib_allocs = g_lib_allocs;
+  out->bytes = g_bytes;
+  out->live_bytes = g_live_bytes;
+  out->peak_live_bytes = g_peak_live_bytes;
+}
+
+void alloc_counter_lib_enter(void) { t_lib_depth++; }
+
+void alloc_counter_lib_exit(void) { t_lib_depth--; }
+
+void alloc_counter_reset_peak(void) { g_peak_live_bytes = g_live_bytes; }
+
+#endif // ALLOC_COUNTER
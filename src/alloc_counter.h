@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Debug counter for heap allocations, to verify the fixed-memory mode doesn't
+// allocate in the steady state. Only available when built with ALLOC_COUNTER
+// defined (make ALLOC_COUNTER=1), in which case malloc, calloc, realloc, the
+// aligned allocators and free are interposed for the whole process, including
+// shared libraries.
+//
+// Allocations are split in two groups: the ones made by ambiencesvc itself,
+// and the ones made while inside a library call marked with
+// alloc_counter_lib_enter/exit (libjpeg, json-c, cairo...), which we can't
+// control.
+//
+// Live (allocated and not yet freed) heap bytes are tracked too, as reported by
+// malloc_usable_size, with a high water mark that can be reset to measure the
+// peak heap use of a block of code.
+
+struct AllocCounters {
+  size_t owned_allocs;
+  size_t lib_allocs;
+  size_t bytes;
+  size_t live_bytes;
+  size_t peak_live_bytes;
+};
+
+#ifdef ALLOC_COUNTER
+bool alloc_counter_enabled(void);
+void alloc_counter_get(struct AllocCounters *out);
+void alloc_counter_lib_enter(void);
+void alloc_counter_lib_exit(void);
+// Set the high water mark of live bytes to the current live bytes
+void alloc_counter_reset_peak(void);
+#else
+static inline bool alloc_counter_enabled(void) { return false; }
+static inline void alloc_counter_get(struct AllocCounters *out) {
+  out->owned_allocs = out->lib_allocs = out->bytes = 0;
+  out->live_bytes = out->peak_live_bytes = 0;
+}
+static inline void alloc_counter_lib_enter(void) {}
+static inline void alloc_counter_lib_exit(void) {}
+static inline void alloc_counter_reset_peak(void) {}
+#endif
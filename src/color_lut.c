@@ -0,0 +1,68 @@
+#include "color_lut.h"
+
+#include <math.h>
+
+// Channel gains at warmth_pct=100: roughly a 6500K white point moved to 3000K
+#define WARM_GAIN_G 0.82
+#define WARM_GAIN_B 0.55
+
+static void color_lut_build_channel(unsigned char *ch, double gain,
+                                    double gamma) {
+  for (size_t i = 0; i < 256; ++i) {
+    const double v = gain * pow(i / 255.0, gamma);
+    const long out = lround(v * 255.0);
+    ch[i] = out < 0 ? 0 : (out > 255 ? 255 : out);
+  }
+}
+
+void color_lut_build(struct ColorLut *lut, size_t brightness_pct,
+                     size_t warmth_pct, size_t gamma_pct) {
+  const double brightness = brightness_pct / 100.0;
+  const double warmth = warmth_pct / 100.0;
+  const double gamma = gamma_pct / 100.0;
+  color_lut_build_channel(lut->r, brightness, gamma);
+  color_lut_build_channel(lut->g, brightness * (1 - warmth * (1 - WARM_GAIN_G)),
+                          gamma);
+  color_lut_build_channel(lut->b, brightness * (1 - warmth * (1 - WARM_GAIN_B)),
+                          gamma);
+}
+
+bool color_lut_is_identity(const struct ColorLut *lut) {
+  for (size_t i = 0; i < 256; ++i) {
+    if ((lut->r[i] != i) || (lut->g[i] != i) || (lut->b[i] != i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void color_lut_apply(const struct ColorLut *lut, unsigned char *px,
+                     size_t n_px) {
+  // A 256 entry table lookup per byte is as cheap as this gets on an ARM1176
+  // (no NEON, and no gather instructions anywhere else either), so the only
+  // thing to do is keep the loop overhead down: 4 pixels per iteration, and
+  // local copies of the table pointers so the compiler doesn't reload them
+  // after every store.
+  const unsigned char *r = lut->r;
+  const unsigned char *g = lut->g;
+  const unsigned char *b = lut->b;
+  for (; n_px >= 4; n_px -= 4, px += 12) {
+    px[0] = r[px[0]];
+    px[1] = g[px[1]];
+    px[2] = b[px[2]];
+    px[3] = r[px[3]];
+    px[4] = g[px[4]];
+    px[5] = b[px[5]];
+    px[6] = r[px[6]];
+    px[7] = g[px[7]];
+    px[8] = b[px[8]];
+    px[9] = r[px[9]];
+    px[10] = g[px[10]];
+    px[11] = b[px[11]];
+  }
+  for (; n_px > 0; --n_px, px += 3) {
+    px[0] = r[px[0]];
+    px[1] = g[px[1]];
+    px[2] = b[px[2]];
+  }
+}
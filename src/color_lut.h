@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Per-channel lookup table to adjust the brightness, colour temperature and
+// gamma of decoded images, so the display can get dimmer and warmer at night.
+struct ColorLut {
+  unsigned char r[256];
+  unsigned char g[256];
+  unsigned char b[256];
+};
+
+// brightness_pct: 100 leaves the image as is, lower values dim it
+// warmth_pct: 0 is neutral, 100 is the warmest white point we support
+// gamma_pct: 100 is neutral, higher values darken mid tones
+void color_lut_build(struct ColorLut *lut, size_t brightness_pct,
+                     size_t warmth_pct, size_t gamma_pct);
+
+// True if applying this LUT would be a no-op
+bool color_lut_is_identity(const struct ColorLut *lut);
+
+// Apply lut in place to n_px packed 24 bit RGB pixels
+void color_lut_apply(const struct ColorLut *lut, unsigned char *px,
+                     size_t n_px);
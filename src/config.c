@@ -12,6 +12,17 @@
 #define SHM_IMAGE_MIN_SIZE_BYTES 2 * 1024 * 1024
 #define SLIDESHOW_SLEEP_TIME_SEC_MIN 5
 #define SLIDESHOW_SLEEP_TIME_SEC_MAX 1000
+#define LOG_MAX_LINES_PER_MIN_DEFAULT 60
+#define LOG_MAX_LINES_PER_MIN_MAX 6000
+#define ADAPTIVE_RES_LATENCY_BUDGET_MS_MIN 100
+#define ADAPTIVE_RES_LATENCY_BUDGET_MS_MAX 60000
+#define AMBIENCE_BRIGHTNESS_PCT_MIN 5
+#define AMBIENCE_GAMMA_PCT_MIN 50
+#define AMBIENCE_GAMMA_PCT_MAX 300
+#define REVGEO_MAX_DISTANCE_KM_DEFAULT 25
+#define REVGEO_MAX_DISTANCE_KM_MAX 1000
+#define POWER_BUDGET_CPU_MS_PER_SLIDE_MAX 600000
+#define POWER_BUDGET_WAKEUPS_PER_HOUR_MAX 100000000
 
 static bool file_is_valid(const char *fpath) {
   FILE *fp = fopen(fpath, "rb");
@@ -62,6 +73,172 @@ static bool cfg_parse_image_metadata_keys(size_t arr_len, size_t idx,
   return jsonobj_strdup(obj, &cfg->image_metadata_keys[idx]);
 }
 
+static bool cfg_alloc_outputs(struct AmbienceSvcConfig *cfg, size_t count) {
+  if (cfg->outputs != NULL) {
+    fprintf(stderr, "Config err: bug, outputs already alloc?\n");
+    return false;
+  }
+
+  const size_t sz = sizeof(struct AmbienceSvcOutput) * count;
+  cfg->outputs = malloc(sz);
+  if (!cfg->outputs) {
+    fprintf(stderr, "Config err: outputs bad alloc\n");
+    return false;
+  }
+
+  memset(cfg->outputs, 0, sz);
+  cfg->outputs_count = count;
+  return true;
+}
+
+static bool cfg_parse_output(size_t arr_len, size_t idx,
+                             struct json_object *obj, void *usr) {
+  struct AmbienceSvcConfig *cfg = usr;
+  if ((cfg->outputs_count == 0) && !cfg_alloc_outputs(cfg, arr_len)) {
+    return false;
+  }
+
+  if (cfg->outputs_count != arr_len) {
+    fprintf(stderr,
+            "Config err: outputs changed size unexpectedly, found %zu, "
+            "expected %zu\n",
+            arr_len, cfg->outputs_count);
+    return false;
+  }
+
+  struct AmbienceSvcOutput *out = &cfg->outputs[idx];
+  bool ok = true;
+  ok &= json_get_size_t(obj, "width", &out->width, IMG_MIN_SIZE_PX,
+                        IMG_MAX_SIZE_PX);
+  ok &= json_get_size_t(obj, "height", &out->height, IMG_MIN_SIZE_PX,
+                        IMG_MAX_SIZE_PX);
+  ok &= json_get_strdup(obj, "shm_image_file_name", &out->shm_image_file_name);
+  // Ignore failure, this is an optional key
+  json_get_optional_strdup(obj, "image_render_proc_name",
+                           &out->image_render_proc_name);
+  // Ignore failure, this is an optional key
+  json_get_optional_strdup(obj, "memfd_socket_path", &out->memfd_socket_path);
+  return ok;
+}
+
+static bool cfg_parse_ambience_schedule(size_t arr_len, size_t idx,
+                                        struct json_object *obj, void *usr) {
+  struct AmbienceSvcConfig *cfg = usr;
+  if (cfg->ambience_schedule_count == 0) {
+    if (cfg->ambience_schedule != NULL) {
+      fprintf(stderr, "Config err: bug, ambience_schedule already alloc?\n");
+      return false;
+    }
+
+    const size_t sz = sizeof(struct AmbienceScheduleEntry) * arr_len;
+    cfg->ambience_schedule = malloc(sz);
+    if (!cfg->ambience_schedule) {
+      fprintf(stderr, "Config err: ambience_schedule bad alloc\n");
+      return false;
+    }
+
+    memset(cfg->ambience_schedule, 0, sz);
+    cfg->ambience_schedule_count = arr_len;
+  }
+
+  if (cfg->ambience_schedule_count != arr_len) {
+    fprintf(stderr,
+            "Config err: ambience_schedule changed size unexpectedly, found "
+            "%zu, expected %zu\n",
+            arr_len, cfg->ambience_schedule_count);
+    return false;
+  }
+
+  struct AmbienceScheduleEntry *e = &cfg->ambience_schedule[idx];
+  size_t hour, minute;
+  bool ok = true;
+  ok &= json_get_size_t(obj, "start_hour", &hour, 0, 23);
+  ok &= json_get_optional_size_t(obj, "start_minute", &minute, 0, 59, 0);
+  ok &= json_get_size_t(obj, "brightness_pct", &e->brightness_pct,
+                        AMBIENCE_BRIGHTNESS_PCT_MIN, 100);
+  ok &= json_get_optional_size_t(obj, "warmth_pct", &e->warmth_pct, 0, 100, 0);
+  ok &= json_get_optional_size_t(obj, "gamma_pct", &e->gamma_pct,
+                                 AMBIENCE_GAMMA_PCT_MIN, AMBIENCE_GAMMA_PCT_MAX,
+                                 100);
+  e->start_minute_of_day = hour * 60 + minute;
+  return ok;
+}
+
+static bool cfg_validate_ambience_schedule(const struct AmbienceSvcConfig *cfg) {
+  for (size_t i = 1; i < cfg->ambience_schedule_count; ++i) {
+    if (cfg->ambience_schedule[i].start_minute_of_day <=
+        cfg->ambience_schedule[i - 1].start_minute_of_day) {
+      fprintf(stderr, "Config err: ambience_schedule entries must be sorted by "
+                      "start time, with no repeated start times\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+// Single output config, from before multiple outputs were supported
+static bool cfg_parse_legacy_output(struct json_object *json,
+                                    struct AmbienceSvcConfig *cfg) {
+  if (!cfg_alloc_outputs(cfg, 1)) {
+    return false;
+  }
+
+  struct AmbienceSvcOutput *out = &cfg->outputs[0];
+  out->width = cfg->image_target_width;
+  out->height = cfg->image_target_height;
+  bool ok = true;
+  ok &= json_get_strdup(json, "shm_image_file_name", &out->shm_image_file_name);
+  // Ignore failure, this is an optional key
+  json_get_optional_strdup(json, "image_render_proc_name",
+                           &out->image_render_proc_name);
+  // Ignore failure, this is an optional key
+  json_get_optional_strdup(json, "memfd_socket_path", &out->memfd_socket_path);
+  return ok;
+}
+
+static bool cfg_validate_outputs(const struct AmbienceSvcConfig *cfg) {
+  if (cfg->outputs_count == 0) {
+    fprintf(stderr, "Config err: no outputs defined\n");
+    return false;
+  }
+
+  for (size_t i = 0; i < cfg->outputs_count; ++i) {
+    for (size_t j = i + 1; j < cfg->outputs_count; ++j) {
+      if (strcmp(cfg->outputs[i].shm_image_file_name,
+                 cfg->outputs[j].shm_image_file_name) == 0) {
+        fprintf(stderr,
+                "Config err: outputs %zu and %zu use the same shm file %s\n",
+                i, j, cfg->outputs[i].shm_image_file_name);
+        return false;
+      }
+
+      // Renderers are found by name, and extra instances of a name are killed
+      if (cfg->outputs[i].image_render_proc_name &&
+          cfg->outputs[j].image_render_proc_name &&
+          (strcmp(cfg->outputs[i].image_render_proc_name,
+                  cfg->outputs[j].image_render_proc_name) == 0)) {
+        fprintf(stderr,
+                "Config err: outputs %zu and %zu use the same renderer %s\n",
+                i, j, cfg->outputs[i].image_render_proc_name);
+        return false;
+      }
+
+      if (cfg->outputs[i].memfd_socket_path &&
+          cfg->outputs[j].memfd_socket_path &&
+          (strcmp(cfg->outputs[i].memfd_socket_path,
+                  cfg->outputs[j].memfd_socket_path) == 0)) {
+        fprintf(stderr,
+                "Config err: outputs %zu and %zu use the same memfd socket "
+                "%s\n",
+                i, j, cfg->outputs[i].memfd_socket_path);
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
 struct AmbienceSvcConfig *ambiencesvc_config_init(const char *fpath) {
   struct json_object *json = NULL;
   struct AmbienceSvcConfig *cfg = malloc(sizeof(struct AmbienceSvcConfig));
@@ -74,9 +251,14 @@ struct AmbienceSvcConfig *ambiencesvc_config_init(const char *fpath) {
   cfg->image_metadata_keys_count = 0;
   cfg->www_svc_url = NULL;
   cfg->www_client_id = NULL;
-  cfg->shm_image_file_name = NULL;
+  cfg->outputs = NULL;
+  cfg->outputs_count = 0;
+  cfg->ambience_schedule = NULL;
+  cfg->ambience_schedule_count = 0;
+  cfg->revgeo_index_path = NULL;
   cfg->shm_leak_image_path = NULL;
-  cfg->image_render_proc_name = NULL;
+  cfg->trace_shm_file_name = NULL;
+  cfg->record_slides_path = NULL;
   cfg->eink_save_render_to_png_file = NULL;
   cfg->eink_hello_message = NULL;
   cfg->eink_goodbye_message = NULL;
@@ -92,6 +274,26 @@ struct AmbienceSvcConfig *ambiencesvc_config_init(const char *fpath) {
                         IMG_MIN_SIZE_PX, IMG_MAX_SIZE_PX);
   ok &= json_get_size_t(json, "image_target_height", &cfg->image_target_height,
                         IMG_MIN_SIZE_PX, IMG_MAX_SIZE_PX);
+  ok &= json_get_optional_bool(json, "adaptive_res_enable",
+                               &cfg->adaptive_res_enable, false);
+  if (cfg->adaptive_res_enable) {
+    ok &= json_get_size_t(json, "adaptive_res_min_width",
+                          &cfg->adaptive_res_min_width, IMG_MIN_SIZE_PX,
+                          IMG_MAX_SIZE_PX);
+    ok &= json_get_size_t(json, "adaptive_res_min_height",
+                          &cfg->adaptive_res_min_height, IMG_MIN_SIZE_PX,
+                          IMG_MAX_SIZE_PX);
+    ok &= json_get_size_t(json, "adaptive_res_max_width",
+                          &cfg->adaptive_res_max_width, IMG_MIN_SIZE_PX,
+                          IMG_MAX_SIZE_PX);
+    ok &= json_get_size_t(json, "adaptive_res_max_height",
+                          &cfg->adaptive_res_max_height, IMG_MIN_SIZE_PX,
+                          IMG_MAX_SIZE_PX);
+    ok &= json_get_size_t(json, "adaptive_res_latency_budget_ms",
+                          &cfg->adaptive_res_latency_budget_ms,
+                          ADAPTIVE_RES_LATENCY_BUDGET_MS_MIN,
+                          ADAPTIVE_RES_LATENCY_BUDGET_MS_MAX);
+  }
   ok &= json_get_bool(json, "image_embed_qr", &cfg->image_embed_qr);
   ok &= json_get_bool(json, "image_request_standalone_qr",
                       &cfg->image_request_standalone_qr);
@@ -101,19 +303,56 @@ struct AmbienceSvcConfig *ambiencesvc_config_init(const char *fpath) {
                      cfg);
   ok &= json_get_strdup(json, "www_svc_url", &cfg->www_svc_url);
   ok &= json_get_strdup(json, "www_client_id", &cfg->www_client_id);
-  ok &= json_get_strdup(json, "shm_image_file_name", &cfg->shm_image_file_name);
+  if (json_has_key(json, "outputs")) {
+    ok &= json_get_arr(json, "outputs", cfg_parse_output, cfg);
+  } else {
+    ok &= cfg_parse_legacy_output(json, cfg);
+  }
+  if (json_has_key(json, "ambience_schedule")) {
+    ok &= json_get_arr(json, "ambience_schedule", cfg_parse_ambience_schedule,
+                       cfg);
+  }
+  // Ignore failure, this is an optional key
+  json_get_optional_strdup(json, "revgeo_index_path", &cfg->revgeo_index_path);
+  ok &= json_get_optional_size_t(
+      json, "revgeo_max_distance_km", &cfg->revgeo_max_distance_km, 1,
+      REVGEO_MAX_DISTANCE_KM_MAX, REVGEO_MAX_DISTANCE_KM_DEFAULT);
   ok &= json_get_size_t(json, "shm_image_max_size_bytes",
                         &cfg->shm_image_max_size_bytes,
                         SHM_IMAGE_MIN_SIZE_BYTES, SHM_IMAGE_MAX_SIZE_BYTES);
+  ok &= json_get_optional_bool(json, "fixed_memory_mode",
+                               &cfg->fixed_memory_mode, false);
+  ok &= json_get_optional_bool(json, "shm_warm_start", &cfg->shm_warm_start,
+                               false);
   ok &= json_get_bool(json, "shm_leak_file", &cfg->shm_leak_file);
   ok &= json_get_strdup(json, "shm_leak_image_path", &cfg->shm_leak_image_path);
-  ok &= json_get_strdup(json, "image_render_proc_name",
-                        &cfg->image_render_proc_name);
   ok &= json_get_size_t(
       json, "slideshow_sleep_time_sec", &cfg->slideshow_sleep_time_sec,
       SLIDESHOW_SLEEP_TIME_SEC_MIN, SLIDESHOW_SLEEP_TIME_SEC_MAX);
   ok &= json_get_bool(json, "eink_mock_display", &cfg->eink_mock_display);
 
+  // Ignore failure, this is an optional key
+  json_get_optional_strdup(json, "record_slides_path",
+                           &cfg->record_slides_path);
+  // Ignore failure, this is an optional key
+  json_get_optional_strdup(json, "trace_shm_file_name",
+                           &cfg->trace_shm_file_name);
+  ok &= json_get_optional_size_t(
+      json, "log_max_lines_per_min", &cfg->log_max_lines_per_min, 0,
+      LOG_MAX_LINES_PER_MIN_MAX, LOG_MAX_LINES_PER_MIN_DEFAULT);
+  ok &= json_get_optional_bool(json, "power_accounting",
+                               &cfg->power_accounting, false);
+  ok &= json_get_optional_size_t(json, "power_budget_cpu_ms_per_slide",
+                                 &cfg->power_budget_cpu_ms_per_slide, 0,
+                                 POWER_BUDGET_CPU_MS_PER_SLIDE_MAX, 0);
+  ok &= json_get_optional_size_t(json, "power_budget_wakeups_per_hour",
+                                 &cfg->power_budget_wakeups_per_hour, 0,
+                                 POWER_BUDGET_WAKEUPS_PER_HOUR_MAX, 0);
+  ok &= json_get_optional_bool(json, "mem_tracking", &cfg->mem_tracking,
+                               false);
+  ok &= json_get_optional_bool(json, "perf_profiling", &cfg->perf_profiling,
+                               false);
+
   // Ignore failure, this is an optional key
   cfg->eink_save_render_to_png_file = NULL;
   json_get_optional_strdup(json, "eink_save_render_to_png_file",
@@ -127,6 +366,10 @@ struct AmbienceSvcConfig *ambiencesvc_config_init(const char *fpath) {
     goto err;
   }
 
+  if (!cfg_validate_outputs(cfg) || !cfg_validate_ambience_schedule(cfg)) {
+    goto err;
+  }
+
   if (cfg->shm_leak_file && !file_is_valid(cfg->shm_leak_image_path)) {
     fprintf(stderr,
             "Config err: shm_leak_image_path must point to a valid file, can't "
@@ -135,6 +378,16 @@ struct AmbienceSvcConfig *ambiencesvc_config_init(const char *fpath) {
     goto err;
   }
 
+  if (cfg->adaptive_res_enable &&
+      ((cfg->adaptive_res_min_width > cfg->image_target_width) ||
+       (cfg->adaptive_res_max_width < cfg->image_target_width) ||
+       (cfg->adaptive_res_min_height > cfg->image_target_height) ||
+       (cfg->adaptive_res_max_height < cfg->image_target_height))) {
+    fprintf(stderr, "Config err: image_target_width/height must be within "
+                    "adaptive_res_min/max bounds\n");
+    goto err;
+  }
+
   if (cfg->image_request_metadata && (cfg->image_metadata_keys_count == 0)) {
     fprintf(stderr, "Config err: image_request_metadata is set, but no "
                     "image_metadata_keys defined\n");
@@ -163,9 +416,19 @@ void ambiencesvc_config_free(struct AmbienceSvcConfig *h) {
   }
   free((void *)h->www_svc_url);
   free((void *)h->www_client_id);
-  free((void *)h->shm_image_file_name);
+  if (h->outputs) {
+    for (size_t i = 0; i < h->outputs_count; ++i) {
+      free((void *)h->outputs[i].shm_image_file_name);
+      free((void *)h->outputs[i].image_render_proc_name);
+      free((void *)h->outputs[i].memfd_socket_path);
+    }
+    free(h->outputs);
+  }
+  free(h->ambience_schedule);
+  free((void *)h->revgeo_index_path);
   free((void *)h->shm_leak_image_path);
-  free((void *)h->image_render_proc_name);
+  free((void *)h->trace_shm_file_name);
+  free((void *)h->record_slides_path);
   free((void*)h->eink_save_render_to_png_file);
   free((void*)h->eink_hello_message);
   free((void*)h->eink_goodbye_message);
@@ -176,6 +439,15 @@ void ambiencesvc_config_print(struct AmbienceSvcConfig *h) {
   printf("AmbienceSvcConfig {\n");
   printf("\timage_target_width=%zu,\n", h->image_target_width);
   printf("\timage_target_height=%zu,\n", h->image_target_height);
+  printf("\tadaptive_res_enable=%d,\n", h->adaptive_res_enable);
+  if (h->adaptive_res_enable) {
+    printf("\tadaptive_res_min=%zux%zu,\n", h->adaptive_res_min_width,
+           h->adaptive_res_min_height);
+    printf("\tadaptive_res_max=%zux%zu,\n", h->adaptive_res_max_width,
+           h->adaptive_res_max_height);
+    printf("\tadaptive_res_latency_budget_ms=%zu,\n",
+           h->adaptive_res_latency_budget_ms);
+  }
   printf("\timage_embed_qr=%d,\n", h->image_embed_qr);
   printf("\timage_request_standalone_qr=%d,\n", h->image_request_standalone_qr);
   printf("\timage_request_metadata=%d,\n", h->image_request_metadata);
@@ -186,12 +458,43 @@ void ambiencesvc_config_print(struct AmbienceSvcConfig *h) {
   }
   printf("\twww_svc_url=%s,\n", h->www_svc_url);
   printf("\twww_client_id=%s,\n", h->www_client_id);
-  printf("\tshm_image_file_name=%s,\n", h->shm_image_file_name);
+  printf("\toutputs_count=%zu,\n", h->outputs_count);
+  for (size_t i = 0; i < h->outputs_count; ++i) {
+    printf("\toutputs[%zu]={%zux%zu, shm_image_file_name=%s, "
+           "image_render_proc_name=%s, memfd_socket_path=%s},\n",
+           i, h->outputs[i].width, h->outputs[i].height,
+           h->outputs[i].shm_image_file_name,
+           h->outputs[i].image_render_proc_name,
+           h->outputs[i].memfd_socket_path);
+  }
+  printf("\tambience_schedule_count=%zu,\n", h->ambience_schedule_count);
+  for (size_t i = 0; i < h->ambience_schedule_count; ++i) {
+    const struct AmbienceScheduleEntry *e = &h->ambience_schedule[i];
+    printf("\tambience_schedule[%zu]={from %02zu:%02zu, brightness_pct=%zu, "
+           "warmth_pct=%zu, gamma_pct=%zu},\n",
+           i, e->start_minute_of_day / 60, e->start_minute_of_day % 60,
+           e->brightness_pct, e->warmth_pct, e->gamma_pct);
+  }
+  printf("\trevgeo_index_path=%s,\n", h->revgeo_index_path);
+  printf("\trevgeo_max_distance_km=%zu,\n", h->revgeo_max_distance_km);
   printf("\tshm_image_max_size_bytes=%zu,\n", h->shm_image_max_size_bytes);
+  printf("\tfixed_memory_mode=%d,\n", h->fixed_memory_mode);
+  printf("\tshm_warm_start=%d,\n", h->shm_warm_start);
   printf("\tshm_leak_file=%d,\n", h->shm_leak_file);
   printf("\tshm_leak_image_path=%s,\n", h->shm_leak_image_path);
-  printf("\timage_render_proc_name=%s,\n", h->image_render_proc_name);
   printf("\tslideshow_sleep_time_sec=%zu,\n", h->slideshow_sleep_time_sec);
+  printf("\trecord_slides_path=%s,\n", h->record_slides_path);
+  printf("\ttrace_shm_file_name=%s,\n", h->trace_shm_file_name);
+  printf("\tlog_max_lines_per_min=%zu,\n", h->log_max_lines_per_min);
+  printf("\tpower_accounting=%d,\n", h->power_accounting);
+  if (h->power_accounting) {
+    printf("\tpower_budget_cpu_ms_per_slide=%zu,\n",
+           h->power_budget_cpu_ms_per_slide);
+    printf("\tpower_budget_wakeups_per_hour=%zu,\n",
+           h->power_budget_wakeups_per_hour);
+  }
+  printf("\tmem_tracking=%d,\n", h->mem_tracking);
+  printf("\tperf_profiling=%d,\n", h->perf_profiling);
   printf("\teink_mock_display=%d,\n", h->eink_mock_display);
   printf("\teink_save_render_to_png_file=%s,\n",
          h->eink_save_render_to_png_file);
@@ -1,11 +1,51 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+// A display that shows the received images
+struct AmbienceSvcOutput {
+  // Images bigger than this are resized to fit before publishing them
+  size_t width;
+  size_t height;
+
+  // File name to store the image in /dev/shm (eg /dev/shm/ambience_img)
+  const char *shm_image_file_name;
+
+  // Optional: image render process name - will notify when an image is updated
+  // with SIGUSR1. If not set, no process is notified (consumers must poll the
+  // shm control block, or use memfd_socket_path).
+  const char *image_render_proc_name;
+
+  // Optional: also publish each image as a sealed memfd to consumers connected
+  // to this unix socket. See memfd_frame.h.
+  const char *memfd_socket_path;
+};
+
+// Image adjustments to apply from some time of the day, until the next entry
+// starts
+struct AmbienceScheduleEntry {
+  // Minutes since midnight, local time
+  size_t start_minute_of_day;
+  // See color_lut_build
+  size_t brightness_pct;
+  size_t warmth_pct;
+  size_t gamma_pct;
+};
+
 struct AmbienceSvcConfig {
   // Target width and height for requested image
   size_t image_target_width;
   size_t image_target_height;
 
+  // Adapt the requested image size so that fetching and publishing a slide
+  // stays within adaptive_res_latency_budget_ms. The target size above is the
+  // starting point, and it will be adjusted within the min/max bounds.
+  bool adaptive_res_enable;
+  size_t adaptive_res_min_width;
+  size_t adaptive_res_min_height;
+  size_t adaptive_res_max_width;
+  size_t adaptive_res_max_height;
+  size_t adaptive_res_latency_budget_ms;
+
   // Should image have an embeded QR code with more info
   bool image_embed_qr;
 
@@ -25,12 +65,37 @@ struct AmbienceSvcConfig {
   // Optional client id when registering to image service
   const char *www_client_id;
 
-  // File name to store the image in /dev/shm (eg /dev/shm/ambience_img)
-  const char *shm_image_file_name;
+  // Displays to publish images to. Either an "outputs" array in the config, or
+  // a single output built from the image_target_width/height,
+  // shm_image_file_name, image_render_proc_name and memfd_socket_path keys.
+  size_t outputs_count;
+  struct AmbienceSvcOutput *outputs;
+
+  // Optional: adjust brightness, white point and gamma of every image based on
+  // the time of day. Sorted by start time; the last entry lasts until the first
+  // one starts again the next day.
+  size_t ambience_schedule_count;
+  struct AmbienceScheduleEntry *ambience_schedule;
+
+  // Optional: index built by revgeo_build, to name the place a picture was
+  // taken from its GPS tags when the image service doesn't provide the
+  // reverse_geo.revgeo metadata key. Places further than
+  // revgeo_max_distance_km from the picture aren't used.
+  const char *revgeo_index_path;
+  size_t revgeo_max_distance_km;
 
   // Will reject to reserve memory for images bigger than this
   size_t shm_image_max_size_bytes;
 
+  // Reserve (and lock in RAM) all per-slide buffers on startup, so the steady
+  // state doesn't touch the heap: image decode/resize/encode buffers and
+  // metadata values
+  bool fixed_memory_mode;
+
+  // On startup, keep the image a previous instance left in the shm area (if
+  // it's valid) instead of clearing it
+  bool shm_warm_start;
+
   // Remove shm file on shutdown or not
   bool shm_leak_file;
 
@@ -38,13 +103,35 @@ struct AmbienceSvcConfig {
   // copy this file to the shm area, then leak it)
   const char *shm_leak_image_path;
 
-  // Image render process name - will notify when an image is updated with
-  // SIGUSR1
-  const char *image_render_proc_name;
-
   // Time between pictures
   size_t slideshow_sleep_time_sec;
 
+  // Optional: append every slide received (image, metadata, QR and timing) to
+  // this file, so it can be replayed later with --replay
+  const char *record_slides_path;
+
+  // Optional: name of a /dev/shm file to keep a binary trace of pipeline
+  // events in. Decode it with ambiencesvc-trace.
+  const char *trace_shm_file_name;
+
+  // Max number of human readable lines per minute to log from the slide
+  // pipeline; 0 to only use the binary trace
+  size_t log_max_lines_per_min;
+
+  // Optional: account for CPU time and wakeups of each slide (see
+  // power_acct.h), and log slides over these budgets. 0 means no budget.
+  bool power_accounting;
+  size_t power_budget_cpu_ms_per_slide;
+  size_t power_budget_wakeups_per_hour;
+
+  // Optional: track RSS, PSS and (with ALLOC_COUNTER) heap use around each
+  // stage of the slide pipeline. See mem_track.h.
+  bool mem_tracking;
+
+  // Optional: count CPU cycles, instructions, cache misses and page faults of
+  // each stage of the slide pipeline. See perf_prof.h.
+  bool perf_profiling;
+
   // Skip displaying things to eInk
   bool eink_mock_display;
 
@@ -0,0 +1,478 @@
+#include "jpeg_resize.h"
+#include "alloc_counter.h"
+
+#include <errno.h>
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jpeglib.h>
+#include <jerror.h>
+
+// Initial size of the encoder output buffer, if the caller didn't provide one
+#define JPEG_DEST_MIN_SZ 4096
+
+// libjpeg's default error handler calls exit(), use one that jumps back to the
+// caller instead
+struct JpegErr {
+  struct jpeg_error_mgr mgr;
+  jmp_buf jmp;
+};
+
+static void jpeg_err_exit(j_common_ptr cinfo) {
+  struct JpegErr *err = (struct JpegErr *)cinfo->err;
+  char msg[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, msg);
+  fprintf(stderr, "jpeg: %s\n", msg);
+  longjmp(err->jmp, 1);
+}
+
+// Don't print warnings for every slightly broken image
+static void jpeg_err_silence(j_common_ptr cinfo) {}
+
+// Growable memory destination for the encoder. libjpeg's own jpeg_mem_dest only
+// hands its buffer back once compression finishes, so it leaks if libjpeg fails
+// halfway; this one keeps the current buffer where the error path can free it.
+struct JpegMemDest {
+  struct jpeg_destination_mgr pub;
+  unsigned char *user_buf;
+  unsigned char *buf;
+  size_t sz;
+};
+
+static void jpeg_mem_dest_nop(j_compress_ptr cinfo) {}
+
+static boolean jpeg_mem_dest_grow(j_compress_ptr cinfo) {
+  struct JpegMemDest *dest = (struct JpegMemDest *)cinfo->dest;
+  const size_t new_sz = dest->sz * 2;
+  unsigned char *new_buf = dest->buf == dest->user_buf
+                               ? malloc(new_sz)
+                               : realloc(dest->buf, new_sz);
+  if (!new_buf) {
+    ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+  }
+  if (dest->buf == dest->user_buf) {
+    memcpy(new_buf, dest->buf, dest->sz);
+  }
+
+  dest->pub.next_output_byte = new_buf + dest->sz;
+  dest->pub.free_in_buffer = new_sz - dest->sz;
+  dest->buf = new_buf;
+  dest->sz = new_sz;
+  return TRUE;
+}
+
+// Same rules as jpeg_encode: use user_buf if set, otherwise allocate one
+static void jpeg_mem_dest_setup(j_compress_ptr cinfo, struct JpegMemDest *dest,
+                                unsigned char *user_buf, size_t user_sz) {
+  dest->pub.init_destination = jpeg_mem_dest_nop;
+  dest->pub.empty_output_buffer = jpeg_mem_dest_grow;
+  dest->pub.term_destination = jpeg_mem_dest_nop;
+  dest->user_buf = user_buf;
+  dest->buf = user_buf;
+  dest->sz = user_buf ? user_sz : 0;
+  if (dest->sz == 0) {
+    dest->buf = malloc(JPEG_DEST_MIN_SZ);
+    if (!dest->buf) {
+      ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+    }
+    dest->sz = JPEG_DEST_MIN_SZ;
+  }
+  dest->pub.next_output_byte = dest->buf;
+  dest->pub.free_in_buffer = dest->sz;
+  cinfo->dest = &dest->pub;
+}
+
+static void jpeg_mem_dest_free(struct JpegMemDest *dest) {
+  if (dest->buf != dest->user_buf) {
+    free(dest->buf);
+  }
+  dest->buf = dest->user_buf;
+}
+
+void rgb_image_free(struct RgbImage *img) {
+  if (!img) {
+    return;
+  }
+
+  if (img->px_owned) {
+    free(img->px);
+  }
+  img->px = NULL;
+  img->px_owned = false;
+  img->width = img->height = 0;
+}
+
+int jpeg_get_size(const void *jpeg, size_t jpeg_sz, size_t *width,
+                  size_t *height) {
+  struct jpeg_decompress_struct cinfo;
+  struct JpegErr err;
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpeg_err_exit;
+  err.mgr.output_message = jpeg_err_silence;
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_decompress(&cinfo);
+    alloc_counter_lib_exit();
+    return -EINVAL;
+  }
+
+  alloc_counter_lib_enter();
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (const unsigned char *)jpeg, jpeg_sz);
+  jpeg_read_header(&cinfo, TRUE);
+  *width = cinfo.image_width;
+  *height = cinfo.image_height;
+  jpeg_destroy_decompress(&cinfo);
+  alloc_counter_lib_exit();
+  return 0;
+}
+
+// Pick the biggest DCT scale down that still leaves enough pixels
+static unsigned jpeg_pick_scale_denom(size_t width, size_t height,
+                                      size_t min_width, size_t min_height) {
+  for (unsigned denom = 8; denom > 1; denom /= 2) {
+    if ((width / denom >= min_width) && (height / denom >= min_height)) {
+      return denom;
+    }
+  }
+  return 1;
+}
+
+static void jpeg_set_dct_scale(struct jpeg_decompress_struct *cinfo,
+                               size_t min_width, size_t min_height) {
+  cinfo->out_color_space = JCS_RGB;
+  cinfo->scale_num = 1;
+  cinfo->scale_denom = jpeg_pick_scale_denom(
+      cinfo->image_width, cinfo->image_height, min_width, min_height);
+  cinfo->dct_method = JDCT_IFAST;
+}
+
+void jpeg_get_decoded_size(size_t width, size_t height, size_t min_width,
+                           size_t min_height, size_t *out_width,
+                           size_t *out_height) {
+  const unsigned denom =
+      jpeg_pick_scale_denom(width, height, min_width, min_height);
+  // Same rounding as libjpeg
+  *out_width = (width + denom - 1) / denom;
+  *out_height = (height + denom - 1) / denom;
+}
+
+int jpeg_decode(const void *jpeg, size_t jpeg_sz, size_t min_width,
+                size_t min_height, unsigned char *buf, size_t buf_sz,
+                struct RgbImage *out) {
+  struct jpeg_decompress_struct cinfo;
+  struct JpegErr err;
+  // volatile: modified after setjmp, read after longjmp
+  unsigned char *volatile px = NULL;
+  volatile bool px_owned = false;
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpeg_err_exit;
+  err.mgr.output_message = jpeg_err_silence;
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_decompress(&cinfo);
+    alloc_counter_lib_exit();
+    if (px_owned) {
+      free(px);
+    }
+    return -EINVAL;
+  }
+
+  alloc_counter_lib_enter();
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (const unsigned char *)jpeg, jpeg_sz);
+  jpeg_read_header(&cinfo, TRUE);
+
+  jpeg_set_dct_scale(&cinfo, min_width, min_height);
+  jpeg_start_decompress(&cinfo);
+  const size_t stride = cinfo.output_width * 3;
+  const size_t px_sz = stride * cinfo.output_height;
+  if (buf && (px_sz <= buf_sz)) {
+    px = buf;
+  } else {
+    alloc_counter_lib_exit();
+    px = malloc(px_sz);
+    px_owned = true;
+    alloc_counter_lib_enter();
+  }
+
+  if (!px) {
+    fprintf(stderr, "jpeg: can't alloc %ux%u image\n", cinfo.output_width,
+            cinfo.output_height);
+    jpeg_destroy_decompress(&cinfo);
+    alloc_counter_lib_exit();
+    return -ENOMEM;
+  }
+
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row = px + cinfo.output_scanline * stride;
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+
+  out->px = px;
+  out->px_owned = px_owned;
+  out->width = cinfo.output_width;
+  out->height = cinfo.output_height;
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  alloc_counter_lib_exit();
+  return 0;
+}
+
+void rgb_image_fit_size(const struct RgbImage *src, size_t max_width,
+                        size_t max_height, size_t *width, size_t *height) {
+  if ((src->width <= max_width) && (src->height <= max_height)) {
+    *width = src->width;
+    *height = src->height;
+  } else if (src->width * max_height > src->height * max_width) {
+    // Width is the limiting dimension
+    *width = max_width;
+    *height = src->height * max_width / src->width;
+  } else {
+    *width = src->width * max_height / src->height;
+    *height = max_height;
+  }
+
+  *width = *width ? *width : 1;
+  *height = *height ? *height : 1;
+}
+
+void rgb_image_resize(const struct RgbImage *src, struct RgbImage *dst) {
+  const size_t src_stride = src->width * 3;
+  for (size_t dy = 0; dy < dst->height; ++dy) {
+    const size_t y0 = dy * src->height / dst->height;
+    size_t y1 = (dy + 1) * src->height / dst->height;
+    y1 = y1 > y0 ? y1 : y0 + 1;
+
+    unsigned char *out = dst->px + dy * dst->width * 3;
+    for (size_t dx = 0; dx < dst->width; ++dx) {
+      const size_t x0 = dx * src->width / dst->width;
+      size_t x1 = (dx + 1) * src->width / dst->width;
+      x1 = x1 > x0 ? x1 : x0 + 1;
+
+      unsigned r = 0, g = 0, b = 0;
+      for (size_t y = y0; y < y1; ++y) {
+        const unsigned char *in = src->px + y * src_stride + x0 * 3;
+        for (size_t x = x0; x < x1; ++x) {
+          r += in[0];
+          g += in[1];
+          b += in[2];
+          in += 3;
+        }
+      }
+
+      const unsigned n = (y1 - y0) * (x1 - x0);
+      out[0] = r / n;
+      out[1] = g / n;
+      out[2] = b / n;
+      out += 3;
+    }
+  }
+}
+
+int jpeg_encode(const struct RgbImage *img, int quality, unsigned char **out,
+                size_t *out_sz) {
+  struct jpeg_compress_struct cinfo;
+  struct JpegErr err;
+  struct JpegMemDest dest = {.user_buf = *out, .buf = *out};
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpeg_err_exit;
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_compress(&cinfo);
+    alloc_counter_lib_exit();
+    jpeg_mem_dest_free(&dest);
+    return -EINVAL;
+  }
+
+  alloc_counter_lib_enter();
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest_setup(&cinfo, &dest, *out, *out_sz);
+  cinfo.image_width = img->width;
+  cinfo.image_height = img->height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_compress(&cinfo, TRUE);
+
+  const size_t stride = img->width * 3;
+  while (cinfo.next_scanline < cinfo.image_height) {
+    JSAMPROW row = img->px + cinfo.next_scanline * stride;
+    jpeg_write_scanlines(&cinfo, &row, 1);
+  }
+
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  alloc_counter_lib_exit();
+  *out = dest.buf;
+  *out_sz = dest.sz - dest.pub.free_in_buffer;
+  return 0;
+}
+
+int jpeg_stream_downscale(const void *jpeg, size_t jpeg_sz, size_t max_width,
+                          size_t max_height, int quality,
+                          const struct ColorLut *lut, unsigned char *scratch,
+                          size_t scratch_sz, size_t max_coef_sz,
+                          unsigned char **out, size_t *out_sz) {
+  struct jpeg_decompress_struct dinfo;
+  struct jpeg_compress_struct cinfo;
+  struct JpegErr err;
+  struct JpegMemDest dest = {.user_buf = *out, .buf = *out};
+  // volatile: modified after setjmp, read after longjmp
+  unsigned char *volatile rows = NULL;
+  volatile bool rows_owned = false;
+
+  // Both objects report to the same handler, so a failure in either one jumps
+  // to a single cleanup path. jpeg_destroy_* is a no-op on a zeroed object.
+  memset(&dinfo, 0, sizeof(dinfo));
+  memset(&cinfo, 0, sizeof(cinfo));
+  dinfo.err = jpeg_std_error(&err.mgr);
+  cinfo.err = &err.mgr;
+  err.mgr.error_exit = jpeg_err_exit;
+  err.mgr.output_message = jpeg_err_silence;
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_decompress(&dinfo);
+    jpeg_destroy_compress(&cinfo);
+    alloc_counter_lib_exit();
+    if (rows_owned) {
+      free(rows);
+    }
+    jpeg_mem_dest_free(&dest);
+    return -EINVAL;
+  }
+
+  alloc_counter_lib_enter();
+  jpeg_create_decompress(&dinfo);
+  jpeg_mem_src(&dinfo, (const unsigned char *)jpeg, jpeg_sz);
+  jpeg_read_header(&dinfo, TRUE);
+
+  if (dinfo.progressive_mode && max_coef_sz) {
+    // Progressive scans refine the whole image at once, so libjpeg keeps the
+    // coefficients of every block in memory until the last scan
+    size_t coef_sz = 0;
+    for (int i = 0; i < dinfo.num_components; ++i) {
+      const jpeg_component_info *comp = &dinfo.comp_info[i];
+      coef_sz += (size_t)comp->width_in_blocks * comp->height_in_blocks *
+                 sizeof(JBLOCK);
+    }
+    if (coef_sz > max_coef_sz) {
+      fprintf(stderr,
+              "jpeg: progressive %ux%u image needs %zu bytes of coefficients "
+              "to stream, limit is %zu\n",
+              dinfo.image_width, dinfo.image_height, coef_sz, max_coef_sz);
+      jpeg_destroy_decompress(&dinfo);
+      alloc_counter_lib_exit();
+      return -E2BIG;
+    }
+  }
+
+  // Target size is based on the full image; the DCT scaling gets us as close
+  // to it as it can for free, and the box filter does the rest
+  const struct RgbImage full = {.px = NULL,
+                                .width = dinfo.image_width,
+                                .height = dinfo.image_height,
+                                .px_owned = false};
+  size_t dst_w, dst_h;
+  rgb_image_fit_size(&full, max_width, max_height, &dst_w, &dst_h);
+  jpeg_set_dct_scale(&dinfo, dst_w, dst_h);
+  jpeg_start_decompress(&dinfo);
+  const size_t src_w = dinfo.output_width;
+  const size_t src_h = dinfo.output_height;
+  // DCT rounding may leave the decoded image a pixel short; never upscale
+  dst_w = dst_w < src_w ? dst_w : src_w;
+  dst_h = dst_h < src_h ? dst_h : src_h;
+
+  // Working set: one accumulator per output sample, the source column where
+  // each output pixel starts, one decoded row and one output row
+  const size_t acc_sz = dst_w * 3 * sizeof(uint32_t);
+  const size_t xs_sz = (dst_w + 1) * sizeof(uint32_t);
+  const size_t rows_sz = acc_sz + xs_sz + src_w * 3 + dst_w * 3;
+  if (scratch && (rows_sz <= scratch_sz)) {
+    rows = scratch;
+  } else {
+    alloc_counter_lib_exit();
+    rows = malloc(rows_sz);
+    rows_owned = true;
+    alloc_counter_lib_enter();
+  }
+
+  if (!rows) {
+    fprintf(stderr, "jpeg: can't alloc %zu bytes of row buffers\n", rows_sz);
+    jpeg_destroy_decompress(&dinfo);
+    alloc_counter_lib_exit();
+    return -ENOMEM;
+  }
+
+  uint32_t *acc = (uint32_t *)rows;
+  uint32_t *xs = (uint32_t *)(rows + acc_sz);
+  JSAMPROW in_row = rows + acc_sz + xs_sz;
+  JSAMPROW out_row = in_row + src_w * 3;
+  // dst_w <= src_w, so every output pixel covers at least one source column
+  for (size_t dx = 0; dx <= dst_w; ++dx) {
+    xs[dx] = dx * src_w / dst_w;
+  }
+
+  jpeg_create_compress(&cinfo);
+  jpeg_mem_dest_setup(&cinfo, &dest, *out, *out_sz);
+  cinfo.image_width = dst_w;
+  cinfo.image_height = dst_h;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, quality, TRUE);
+  cinfo.dct_method = JDCT_IFAST;
+  jpeg_start_compress(&cinfo, TRUE);
+
+  for (size_t dy = 0; dy < dst_h; ++dy) {
+    const size_t y0 = dinfo.output_scanline;
+    const size_t y1 = (dy + 1) * src_h / dst_h;
+    memset(acc, 0, acc_sz);
+    while (dinfo.output_scanline < y1) {
+      jpeg_read_scanlines(&dinfo, &in_row, 1);
+      uint32_t *a = acc;
+      for (size_t dx = 0; dx < dst_w; ++dx) {
+        const unsigned char *in = in_row + xs[dx] * 3;
+        uint32_t r = 0, g = 0, b = 0;
+        for (size_t x = xs[dx]; x < xs[dx + 1]; ++x) {
+          r += in[0];
+          g += in[1];
+          b += in[2];
+          in += 3;
+        }
+        a[0] += r;
+        a[1] += g;
+        a[2] += b;
+        a += 3;
+      }
+    }
+
+    unsigned char *o = out_row;
+    const uint32_t *a = acc;
+    for (size_t dx = 0; dx < dst_w; ++dx) {
+      const uint32_t n = (y1 - y0) * (xs[dx + 1] - xs[dx]);
+      o[0] = a[0] / n;
+      o[1] = a[1] / n;
+      o[2] = a[2] / n;
+      o += 3;
+      a += 3;
+    }
+    if (lut) {
+      color_lut_apply(lut, out_row, dst_w);
+    }
+    jpeg_write_scanlines(&cinfo, &out_row, 1);
+  }
+
+  jpeg_finish_decompress(&dinfo);
+  jpeg_destroy_decompress(&dinfo);
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  alloc_counter_lib_exit();
+  if (rows_owned) {
+    free(rows);
+  }
+  *out = dest.buf;
+  *out_sz = dest.sz - dest.pub.free_in_buffer;
+  return 0;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "color_lut.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Helpers to downscale JPEG images with libjpeg: decode (using libjpeg's DCT
+// scaling to skip as much work as possible), box-filter resize, re-encode.
+
+// Packed 24 bit RGB pixels
+struct RgbImage {
+  unsigned char *px;
+  size_t width;
+  size_t height;
+  // If false, px belongs to someone else (eg an arena) and won't be freed
+  bool px_owned;
+};
+
+void rgb_image_free(struct RgbImage *img);
+
+// Read the size of a JPEG image, without decoding it.
+// Returns 0 on success, an error code in any other case
+int jpeg_get_size(const void *jpeg, size_t jpeg_sz, size_t *width,
+                  size_t *height);
+
+// Size jpeg_decode will produce for a width x height image, given the same
+// min_width and min_height
+void jpeg_get_decoded_size(size_t width, size_t height, size_t min_width,
+                           size_t min_height, size_t *out_width,
+                           size_t *out_height);
+
+// Decode a JPEG image. If the image is bigger than min_width x min_height, the
+// decoder may downscale it by up to 8x while decoding, as long as the result
+// is still at least min_width x min_height. The image is decoded into buf if
+// it's big enough, or into a new heap buffer otherwise. out must be freed with
+// rgb_image_free.
+// Returns 0 on success, an error code in any other case
+int jpeg_decode(const void *jpeg, size_t jpeg_sz, size_t min_width,
+                size_t min_height, unsigned char *buf, size_t buf_sz,
+                struct RgbImage *out);
+
+// Size of src once resized to fit in max_width x max_height, keeping its aspect
+// ratio. Never upscales.
+void rgb_image_fit_size(const struct RgbImage *src, size_t max_width,
+                        size_t max_height, size_t *width, size_t *height);
+
+// Box-filter downscale src into dst. dst->width and dst->height must be set to
+// the target size, and dst->px must have space for the resized image.
+void rgb_image_resize(const struct RgbImage *src, struct RgbImage *dst);
+
+// Encode img as a JPEG. If *out is set, it's used as the output buffer
+// (*out_sz must be its size). If it's not big enough, or *out is NULL, a new
+// buffer is allocated: if *out changed, the caller must free it.
+// Returns 0 on success, an error code in any other case
+int jpeg_encode(const struct RgbImage *img, int quality, unsigned char **out,
+                size_t *out_sz);
+
+// Downscale a JPEG to fit in max_width x max_height (keeping its aspect ratio,
+// never upscaling) and re-encode it, without ever holding the decoded image in
+// memory: scanlines are decoded, box-filtered and fed to the encoder one at a
+// time, so the working set is a couple of rows plus libjpeg's own MCU buffers.
+// Use this for images too big to decode in one go. If lut is set, it's applied
+// to each row after downscaling. Row buffers are taken from scratch if it's big
+// enough, or from the heap otherwise. *out follows the same rules as in
+// jpeg_encode.
+// Progressive JPEGs are the exception: libjpeg can't decode them a row at a
+// time, and buffers the DCT coefficients of the whole image (about 2 bytes per
+// pixel per component, at full resolution). If that would take more than
+// max_coef_sz bytes (0 means no limit), the image is rejected with -E2BIG.
+// Returns 0 on success, an error code in any other case
+int jpeg_stream_downscale(const void *jpeg, size_t jpeg_sz, size_t max_width,
+                          size_t max_height, int quality,
+                          const struct ColorLut *lut, unsigned char *scratch,
+                          size_t scratch_sz, size_t max_coef_sz,
+                          unsigned char **out, size_t *out_sz);
@@ -1,5 +1,6 @@
 #include "json.h"
 
+#include <ctype.h>
 #include <json-c/json.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,6 +28,10 @@ void json_free(struct json_object *h) {
   json_object_put(h);
 }
 
+bool json_has_key(struct json_object *h, const char *k) {
+  return json_object_object_get_ex(h, k, NULL);
+}
+
 static bool jsonobj_strdup_impl(struct json_object *h, const char *k,
                                 const char **v, bool is_optional) {
   const char *json_v = json_object_get_string(h);
@@ -91,12 +96,16 @@ bool json_get_int(struct json_object *h, const char *k, int *v) {
   return false;
 }
 
-bool json_get_size_t(struct json_object *h, const char *k, size_t *v,
-                     size_t min, size_t max) {
+static bool json_get_size_t_impl(struct json_object *h, const char *k,
+                                 size_t *v, size_t min, size_t max,
+                                 bool is_optional) {
   int iv;
   if (!json_get_int(h, k, &iv)) {
-    fprintf(stderr,
-            "Failed to read config: can't find value %s of type size_t\n", k);
+    if (!is_optional) {
+      fprintf(stderr,
+              "Failed to read config: can't find value %s of type size_t\n",
+              k);
+    }
     return false;
   }
 
@@ -112,17 +121,47 @@ bool json_get_size_t(struct json_object *h, const char *k, size_t *v,
   return true;
 }
 
-bool json_get_bool(struct json_object *h, const char *k, bool *v) {
+bool json_get_size_t(struct json_object *h, const char *k, size_t *v,
+                     size_t min, size_t max) {
+  return json_get_size_t_impl(h, k, v, min, max, false);
+}
+
+bool json_get_optional_size_t(struct json_object *h, const char *k, size_t *v,
+                              size_t min, size_t max, size_t default_v) {
+  if (!json_has_key(h, k)) {
+    *v = default_v;
+    return true;
+  }
+
+  return json_get_size_t_impl(h, k, v, min, max, false);
+}
+
+static bool json_get_bool_impl(struct json_object *h, const char *k, bool *v,
+                               bool is_optional) {
   struct json_object *n;
   if (json_object_object_get_ex(h, k, &n)) {
     *v = json_object_get_boolean(n);
     return true;
   }
 
-  fprintf(stderr, "Failed to read config: can't find bool value %s\n", k);
+  if (!is_optional) {
+    fprintf(stderr, "Failed to read config: can't find bool value %s\n", k);
+  }
   return false;
 }
 
+bool json_get_bool(struct json_object *h, const char *k, bool *v) {
+  return json_get_bool_impl(h, k, v, false);
+}
+
+bool json_get_optional_bool(struct json_object *h, const char *k, bool *v,
+                            bool default_v) {
+  if (!json_get_bool_impl(h, k, v, true)) {
+    *v = default_v;
+  }
+  return true;
+}
+
 bool json_get_arr(struct json_object *h, const char *k, arr_parse_cb cb,
                   void *usr) {
   struct json_object *arr;
@@ -202,3 +241,215 @@ const char *json_get_nested_key(struct json_object *obj, const char *key) {
           key, max_depth);
   return NULL;
 }
+
+static const char *jscan_ws(const char *p) {
+  while (isspace((unsigned char)*p)) {
+    p++;
+  }
+  return p;
+}
+
+// p points to the opening quote of a string. Returns a pointer past the closing
+// quote, or NULL if the string is not terminated
+static const char *jscan_str(const char *p) {
+  for (p++; *p; p++) {
+    if (*p == '\\') {
+      if (!*++p) {
+        return NULL;
+      }
+    } else if (*p == '"') {
+      return p + 1;
+    }
+  }
+  return NULL;
+}
+
+// Skip any JSON value. Returns a pointer past the value, or NULL if it can't be
+// parsed
+static const char *jscan_value(const char *p) {
+  p = jscan_ws(p);
+  if (*p == '"') {
+    return jscan_str(p);
+  }
+
+  if ((*p == '{') || (*p == '[')) {
+    size_t depth = 0;
+    while (*p) {
+      if (*p == '"') {
+        if (!(p = jscan_str(p))) {
+          return NULL;
+        }
+        continue;
+      }
+
+      if ((*p == '{') || (*p == '[')) {
+        depth++;
+      } else if ((*p == '}') || (*p == ']')) {
+        if (--depth == 0) {
+          return p + 1;
+        }
+      }
+      p++;
+    }
+    return NULL;
+  }
+
+  // Number, true, false or null
+  const char *start = p;
+  while (*p && (*p != ',') && (*p != '}') && (*p != ']') &&
+         !isspace((unsigned char)*p)) {
+    p++;
+  }
+  return p > start ? p : NULL;
+}
+
+// p points to an object. Returns a pointer to the value of key, or NULL if the
+// key isn't in the object
+static const char *jscan_find_key(const char *p, const char *key,
+                                  size_t key_len) {
+  p = jscan_ws(p);
+  if (*p != '{') {
+    return NULL;
+  }
+
+  p = jscan_ws(p + 1);
+  while (*p == '"') {
+    const char *k = p + 1;
+    const char *k_end = jscan_str(p);
+    if (!k_end) {
+      return NULL;
+    }
+
+    const bool match =
+        ((size_t)(k_end - 1 - k) == key_len) && !strncmp(k, key, key_len);
+    p = jscan_ws(k_end);
+    if (*p != ':') {
+      return NULL;
+    }
+
+    p = jscan_ws(p + 1);
+    if (match) {
+      return p;
+    }
+
+    if (!(p = jscan_value(p))) {
+      return NULL;
+    }
+
+    p = jscan_ws(p);
+    if (*p != ',') {
+      return NULL;
+    }
+    p = jscan_ws(p + 1);
+  }
+
+  return NULL;
+}
+
+static void jscan_put(char *out, size_t out_sz, size_t *n, char c) {
+  if (*n + 1 < out_sz) {
+    out[(*n)++] = c;
+  }
+}
+
+// Copy the value at p to out. Strings are unescaped, anything else is copied
+// verbatim
+static bool jscan_copy_value(const char *p, char *out, size_t out_sz) {
+  size_t n = 0;
+  if (*p != '"') {
+    const char *end = jscan_value(p);
+    if (!end) {
+      return false;
+    }
+
+    n = end - p < out_sz ? end - p : out_sz - 1;
+    memcpy(out, p, n);
+    out[n] = '\0';
+    return true;
+  }
+
+  for (p++; *p && (*p != '"'); p++) {
+    if (*p != '\\') {
+      jscan_put(out, out_sz, &n, *p);
+      continue;
+    }
+
+    switch (*++p) {
+    case 'b': jscan_put(out, out_sz, &n, '\b'); break;
+    case 'f': jscan_put(out, out_sz, &n, '\f'); break;
+    case 'n': jscan_put(out, out_sz, &n, '\n'); break;
+    case 'r': jscan_put(out, out_sz, &n, '\r'); break;
+    case 't': jscan_put(out, out_sz, &n, '\t'); break;
+    case 'u': {
+      unsigned cp = 0;
+      for (size_t i = 0; i < 4; ++i) {
+        if (!isxdigit((unsigned char)p[1])) {
+          return false;
+        }
+        const char c = *++p;
+        cp = cp * 16 + (isdigit((unsigned char)c) ? c - '0'
+                                                   : (tolower(c) - 'a' + 10));
+      }
+
+      // Surrogate pairs are not supported, replace them
+      if ((cp >= 0xD800) && (cp <= 0xDFFF)) {
+        cp = '?';
+      }
+
+      // Don't write half a UTF-8 sequence if the value is truncated
+      const size_t cp_len = cp < 0x80 ? 1 : cp < 0x800 ? 2 : 3;
+      if (n + cp_len + 1 > out_sz) {
+        n = out_sz - 1;
+      } else if (cp_len == 1) {
+        out[n++] = cp;
+      } else if (cp_len == 2) {
+        out[n++] = 0xC0 | (cp >> 6);
+        out[n++] = 0x80 | (cp & 0x3F);
+      } else {
+        out[n++] = 0xE0 | (cp >> 12);
+        out[n++] = 0x80 | ((cp >> 6) & 0x3F);
+        out[n++] = 0x80 | (cp & 0x3F);
+      }
+      break;
+    }
+    case '\0':
+      return false;
+    default:
+      // \" \\ \/
+      jscan_put(out, out_sz, &n, *p);
+    }
+  }
+
+  out[n] = '\0';
+  return *p == '"';
+}
+
+bool json_str_get_nested_key(const char *json, const char *key, char *out,
+                             size_t out_sz) {
+  if (!json || !out || (out_sz == 0)) {
+    return false;
+  }
+
+  const char *p = json;
+  while (true) {
+    const char *subkey_end = strchr(key, '.');
+    const size_t subkey_len = subkey_end ? (size_t)(subkey_end - key) : strlen(key);
+    if (subkey_len == 0) {
+      return false;
+    }
+
+    if (!(p = jscan_find_key(p, key, subkey_len))) {
+      return false;
+    }
+
+    if (!subkey_end) {
+      // json-c has no string for null values, behave the same way
+      if (strncmp(p, "null", 4) == 0) {
+        return false;
+      }
+      return jscan_copy_value(p, out, out_sz);
+    }
+
+    key = subkey_end + 1;
+  }
+}
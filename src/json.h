@@ -7,6 +7,7 @@ struct json_object;
 
 struct json_object *json_init(const char *fpath);
 void json_free(struct json_object *h);
+bool json_has_key(struct json_object *h, const char *k);
 bool json_get_strdup(struct json_object *h, const char *k, const char **v);
 bool json_get_optional_strdup(struct json_object *h, const char *k,
                               const char **v);
@@ -15,6 +16,13 @@ bool json_get_size_t(struct json_object *h, const char *k, size_t *v,
                      size_t min, size_t max);
 bool json_get_bool(struct json_object *h, const char *k, bool *v);
 
+// Optional variants: if the key is missing, v is set to default_v and the call
+// succeeds. If the key is present but invalid, the call fails.
+bool json_get_optional_size_t(struct json_object *h, const char *k, size_t *v,
+                              size_t min, size_t max, size_t default_v);
+bool json_get_optional_bool(struct json_object *h, const char *k, bool *v,
+                            bool default_v);
+
 // Invoke a callback for each element of an array
 typedef bool (*arr_parse_cb)(size_t arr_len, size_t idx, struct json_object *,
                              void *usr);
@@ -27,3 +35,11 @@ const char *json_get_nested_key(struct json_object *obj, const char *key);
 
 // Helper to retrieve a string without a key (eg in an arr)
 bool jsonobj_strdup(struct json_object *h, const char **v);
+
+// Same as json_get_nested_key, but scans a JSON string directly instead of a
+// parsed json-c tree, so it never allocates. The value is copied to out
+// (truncated to out_sz, and unescaped if it's a string). Keys with escaped
+// characters are not supported.
+// Returns false if the key doesn't exist or the JSON can't be parsed
+bool json_str_get_nested_key(const char *json, const char *key, char *out,
+                             size_t out_sz);
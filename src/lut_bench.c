@@ -0,0 +1,244 @@
+// lut_bench: time the whole LUT stage (decode the received JPEG, apply the
+// LUT, encode it again) on a frame of the given size, to check it fits
+// comfortably within the slideshow dwell time on the target. The LUT itself is
+// also timed with a one-pixel-per-iteration loop, as a baseline for the kernel.
+//
+// Without -i, the input is a synthetic frame (smooth gradients plus some
+// noise, so the codec does about as much work as with a photo). With -i, a
+// real JPEG is used instead, at its own size.
+//
+// Usage: lut_bench [-w width] [-h height] [-n iterations] [-d dwell_sec]
+//                  [-i image.jpg]
+
+#include "color_lut.h"
+#include "jpeg_resize.h"
+#include "time_utils.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define BENCH_JPEG_QUALITY 90
+
+static void lut_apply_baseline(const struct ColorLut *lut, unsigned char *px,
+                               size_t n_px) {
+  for (size_t i = 0; i < n_px; ++i, px += 3) {
+    px[0] = lut->r[px[0]];
+    px[1] = lut->g[px[1]];
+    px[2] = lut->b[px[2]];
+  }
+}
+
+typedef void (*lut_apply_fn)(const struct ColorLut *, unsigned char *, size_t);
+
+// Average time of each step of the stage, per frame
+struct StageTimes {
+  uint64_t decode_ns;
+  uint64_t apply_ns;
+  uint64_t encode_ns;
+};
+
+struct BenchFrame {
+  const unsigned char *jpeg;
+  size_t jpeg_sz;
+  size_t width;
+  size_t height;
+  // Big enough for the decoded and for the encoded frame, so the benchmark
+  // doesn't measure the allocator
+  unsigned char *px;
+  unsigned char *out;
+  size_t buf_sz;
+};
+
+static int bench(lut_apply_fn fn, const struct ColorLut *lut,
+                 const struct BenchFrame *f, size_t iterations,
+                 struct StageTimes *t) {
+  memset(t, 0, sizeof(*t));
+  // First run warms up caches and pages in the buffers, and isn't counted
+  for (size_t i = 0; i <= iterations; ++i) {
+    const uint64_t start_ns = time_now_ns();
+    struct RgbImage img;
+    if (jpeg_decode(f->jpeg, f->jpeg_sz, f->width, f->height, f->px,
+                    f->buf_sz, &img) != 0) {
+      return -1;
+    }
+    const uint64_t decoded_ns = time_now_ns();
+    fn(lut, img.px, img.width * img.height);
+    const uint64_t applied_ns = time_now_ns();
+    unsigned char *out = f->out;
+    size_t out_sz = f->buf_sz;
+    const int ret = jpeg_encode(&img, BENCH_JPEG_QUALITY, &out, &out_sz);
+    const uint64_t encoded_ns = time_now_ns();
+    rgb_image_free(&img);
+    if (out != f->out) {
+      free(out);
+    }
+    if (ret != 0) {
+      return -1;
+    }
+
+    if (i > 0) {
+      t->decode_ns += decoded_ns - start_ns;
+      t->apply_ns += applied_ns - decoded_ns;
+      t->encode_ns += encoded_ns - applied_ns;
+    }
+  }
+
+  t->decode_ns /= iterations;
+  t->apply_ns /= iterations;
+  t->encode_ns /= iterations;
+  return 0;
+}
+
+static void report(const char *name, uint64_t ns_per_frame, size_t n_px,
+                   size_t dwell_sec) {
+  const double ms = ns_per_frame / 1e6;
+  printf("%-10s %8.2f ms/frame, %7.1f Mpx/s, %.3f%% of a %zus dwell\n", name,
+         ms, n_px / (ns_per_frame / 1e3), 100.0 * ms / (dwell_sec * 1e3),
+         dwell_sec);
+}
+
+static unsigned char *read_file(const char *path, size_t *sz) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    perror("Can't open input image");
+    return NULL;
+  }
+
+  struct stat st;
+  unsigned char *buf = NULL;
+  if ((fstat(fileno(fp), &st) == 0) && (st.st_size > 0)) {
+    buf = malloc(st.st_size);
+  }
+  if (!buf || (fread(buf, 1, st.st_size, fp) != (size_t)st.st_size)) {
+    fprintf(stderr, "Can't read input image %s\n", path);
+    free(buf);
+    fclose(fp);
+    return NULL;
+  }
+
+  fclose(fp);
+  *sz = st.st_size;
+  return buf;
+}
+
+static unsigned char *make_synthetic_jpeg(size_t width, size_t height,
+                                          size_t *sz) {
+  struct RgbImage img = {.px = malloc(width * height * 3),
+                         .width = width,
+                         .height = height,
+                         .px_owned = true};
+  if (!img.px) {
+    perror("Can't alloc frame");
+    return NULL;
+  }
+
+  srand(42);
+  unsigned char *px = img.px;
+  for (size_t y = 0; y < height; ++y) {
+    for (size_t x = 0; x < width; ++x) {
+      const int noise = rand() % 16;
+      px[0] = (x * 255 / width + noise) & 0xff;
+      px[1] = (y * 255 / height + noise) & 0xff;
+      px[2] = ((x + y) * 255 / (width + height) + noise) & 0xff;
+      px += 3;
+    }
+  }
+
+  unsigned char *jpeg = NULL;
+  const int ret = jpeg_encode(&img, BENCH_JPEG_QUALITY, &jpeg, sz);
+  rgb_image_free(&img);
+  if (ret != 0) {
+    fprintf(stderr, "Can't encode synthetic frame\n");
+    return NULL;
+  }
+  return jpeg;
+}
+
+int main(int argc, char **argv) {
+  size_t width = 800;
+  size_t height = 480;
+  size_t iterations = 50;
+  size_t dwell_sec = 15;
+  const char *input_path = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "w:h:n:d:i:")) != -1) {
+    switch (opt) {
+    case 'w': width = strtoul(optarg, NULL, 10); break;
+    case 'h': height = strtoul(optarg, NULL, 10); break;
+    case 'n': iterations = strtoul(optarg, NULL, 10); break;
+    case 'd': dwell_sec = strtoul(optarg, NULL, 10); break;
+    case 'i': input_path = optarg; break;
+    default:
+      fprintf(stderr,
+              "Usage: %s [-w width] [-h height] [-n iterations] "
+              "[-d dwell_sec] [-i image.jpg]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+
+  if (!width || !height || !iterations || !dwell_sec) {
+    fprintf(stderr, "All arguments must be non-zero\n");
+    return 1;
+  }
+
+  struct BenchFrame f = {.width = width, .height = height};
+  unsigned char *jpeg = input_path
+                            ? read_file(input_path, &f.jpeg_sz)
+                            : make_synthetic_jpeg(width, height, &f.jpeg_sz);
+  if (!jpeg || (jpeg_get_size(jpeg, f.jpeg_sz, &f.width, &f.height) != 0)) {
+    fprintf(stderr, "Can't read input JPEG\n");
+    free(jpeg);
+    return 1;
+  }
+  f.jpeg = jpeg;
+
+  // An encoded frame that doesn't fit in the raw pixels would be unusual, but
+  // jpeg_encode grows its buffer if needed
+  const size_t n_px = f.width * f.height;
+  f.buf_sz = n_px * 3;
+  f.px = malloc(f.buf_sz);
+  f.out = malloc(f.buf_sz);
+  if (!f.px || !f.out) {
+    perror("Can't alloc frame");
+    free(f.px);
+    free(f.out);
+    free(jpeg);
+    return 1;
+  }
+
+  // Night settings, the most expensive to build (not to apply: every LUT
+  // costs the same to apply)
+  struct ColorLut lut;
+  uint64_t start_ns = time_now_ns();
+  color_lut_build(&lut, 40, 100, 120);
+  const uint64_t build_ns = time_now_ns() - start_ns;
+
+  struct StageTimes baseline, kernel;
+  int ret = 0;
+  if ((bench(lut_apply_baseline, &lut, &f, iterations, &baseline) != 0) ||
+      (bench(color_lut_apply, &lut, &f, iterations, &kernel) != 0)) {
+    fprintf(stderr, "Can't run LUT stage on input JPEG\n");
+    ret = 1;
+  } else {
+    printf("%zux%zu frame (%zu byte JPEG), %zu iterations\n", f.width,
+           f.height, f.jpeg_sz, iterations);
+    printf("%-10s %8.2f ms\n", "build", build_ns / 1e6);
+    report("decode", kernel.decode_ns, n_px, dwell_sec);
+    report("baseline", baseline.apply_ns, n_px, dwell_sec);
+    report("kernel", kernel.apply_ns, n_px, dwell_sec);
+    report("encode", kernel.encode_ns, n_px, dwell_sec);
+    report("stage",
+           kernel.decode_ns + kernel.apply_ns + kernel.encode_ns, n_px,
+           dwell_sec);
+  }
+
+  free(f.px);
+  free(f.out);
+  free(jpeg);
+  return ret;
+}
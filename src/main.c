@@ -1,16 +1,28 @@
+#include "adaptive_res.h"
+#include "alloc_counter.h"
 #include "config.h"
 #include "libeink/cairo_helpers.h"
 #include "libeink/eink.h"
 #include "libwwwslide/wwwslider.h"
-#include "proc_utils.h"
-#include "shm.h"
-
+#include "mem_arena.h"
+#include "mem_track.h"
+#include "outputs.h"
+#include "perf_prof.h"
+#include "power_acct.h"
+#include "revgeo.h"
+#include "slide_record.h"
+#include "time_utils.h"
+#include "trace.h"
+
+#include <assert.h>
 #include <cairo/cairo.h>
 #include <signal.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -20,22 +32,79 @@
 json_object* parse_meta(const char *meta_json) {
   json_object *jobj = meta_json? json_tokener_parse(meta_json) : NULL;
   if (jobj == NULL) {
-    fprintf(stderr, "Error parsing JSON string\n");
+    trace_event(TRACE_EV_META_PARSE_FAILED, meta_json ? strlen(meta_json) : 0,
+                0, 0);
+    trace_log(stderr, "Error parsing JSON string\n");
     return NULL;
   }
 
   struct json_object *remotepath;
   if (json_object_object_get_ex(jobj, "local_path", &remotepath)) {
     const char *v = json_object_get_string(remotepath);
-    printf("Received file %s\n", v);
+    trace_event_str(TRACE_EV_META_PARSED, v);
+    trace_log(stdout, "Received file %s\n", v);
   } else {
-    printf("Received unknown file %s\n", meta_json);
+    trace_event_str(TRACE_EV_META_PARSED, NULL);
+    trace_log(stdout, "Received unknown file %s\n", meta_json);
   }
 
   return jobj;
 }
 
-void cairo_render_meta(cairo_t* cr, json_object* jobj, const char** meta_keys, size_t meta_keys_sz) {
+// Max size of each metadata value in fixed memory mode, longer values are
+// truncated
+#define META_VALUE_MAX_SZ 256
+// Slides before the fixed memory mode reaches its steady state (eg caches in
+// libraries warm up, stdio buffers get allocated...)
+#define FIXED_MEMORY_WARMUP_SLIDES 3
+
+// Fixed memory mode version of parse_meta: scan the metadata JSON without
+// building a json-c tree, and copy the values to render into the arena.
+// Returns false if the metadata can't be parsed.
+bool parse_meta_fixed(struct MemArena *arena, const char *meta_json,
+                      const char **meta_keys, const char **values,
+                      size_t meta_keys_sz) {
+  mem_arena_reset(arena);
+  char *local_path = mem_arena_alloc(arena, META_VALUE_MAX_SZ);
+  if (!meta_json || !local_path) {
+    trace_event(TRACE_EV_META_PARSE_FAILED, 0, 0, 0);
+    trace_log(stderr, "Error parsing JSON string\n");
+    return false;
+  }
+
+  const bool has_path = json_str_get_nested_key(meta_json, "local_path",
+                                                local_path, META_VALUE_MAX_SZ);
+  bool found_any = has_path;
+  for (size_t i = 0; i < meta_keys_sz; ++i) {
+    char *v = mem_arena_alloc(arena, META_VALUE_MAX_SZ);
+    values[i] = v && json_str_get_nested_key(meta_json, meta_keys[i], v,
+                                             META_VALUE_MAX_SZ)
+                    ? v
+                    : NULL;
+    found_any |= values[i] != NULL;
+  }
+
+  // Can't tell apart broken JSON from missing keys without parsing all of it
+  if (!found_any) {
+    trace_event(TRACE_EV_META_PARSE_FAILED, strlen(meta_json), 0, 0);
+    trace_log(stderr, "Error parsing JSON string\n");
+    return false;
+  }
+
+  if (has_path) {
+    trace_event_str(TRACE_EV_META_PARSED, local_path);
+    trace_log(stdout, "Received file %s\n", local_path);
+  } else {
+    trace_event_str(TRACE_EV_META_PARSED, NULL);
+    trace_log(stdout, "Received unknown file %s\n", meta_json);
+  }
+
+  return true;
+}
+
+// Render metadata values (may be NULL if a value is missing). If values is
+// NULL, the metadata couldn't be loaded.
+void cairo_render_meta(cairo_t* cr, const char** values, size_t values_sz) {
   cairo_surface_t *surface = cairo_get_target(cr);
 
   // Set text properties (black, fully opaque)
@@ -44,10 +113,10 @@ void cairo_render_meta(cairo_t* cr, json_object* jobj, const char** meta_keys, s
                          CAIRO_FONT_WEIGHT_NORMAL);
   cairo_set_font_size(cr, 16);
 
-  if (jobj) {
+  if (values) {
     size_t y = 1;
-    for (size_t i = 0; i < meta_keys_sz; ++i) {
-      const char *v = json_get_nested_key(jobj, meta_keys[i]);
+    for (size_t i = 0; i < values_sz; ++i) {
+      const char *v = values[i];
       if (v) {
         const size_t rendered_lns = cairo_render_text(cr, v, y);
         y += rendered_lns;
@@ -97,54 +166,277 @@ void cairo_render_meta(cairo_t* cr, json_object* jobj, const char** meta_keys, s
   }
 }
 
-void eink_render_meta(struct EInkDisplay *eink, const char* meta_json, const char** meta_keys, size_t meta_keys_sz) {
+// Metadata key for the place a picture was taken. If the image service doesn't
+// provide it, we can try to figure it out ourselves.
+#define REVGEO_META_KEY "reverse_geo.revgeo"
+
+// If arena is set, render without allocating anything ourselves (fixed memory
+// mode). If revgeo is set, it's used to fill in REVGEO_META_KEY when missing.
+void eink_render_meta(struct EInkDisplay *eink, struct MemArena *arena,
+                      struct RevGeo *revgeo, const char *meta_json,
+                      const char **meta_keys, size_t meta_keys_sz) {
+  const char *values[meta_keys_sz];
+  bool meta_ok;
+  json_object *meta = NULL;
+  if (arena) {
+    meta_ok = parse_meta_fixed(arena, meta_json, meta_keys, values, meta_keys_sz);
+  } else {
+    alloc_counter_lib_enter();
+    meta = parse_meta(meta_json);
+    meta_ok = meta != NULL;
+    for (size_t i = 0; meta_ok && i < meta_keys_sz; ++i) {
+      values[i] = json_get_nested_key(meta, meta_keys[i]);
+    }
+    alloc_counter_lib_exit();
+  }
+
+  for (size_t i = 0; revgeo && meta_ok && i < meta_keys_sz; ++i) {
+    if ((!values[i] || !values[i][0]) &&
+        (strcmp(meta_keys[i], REVGEO_META_KEY) == 0)) {
+      values[i] = revgeo_lookup_meta(revgeo, meta_json);
+    }
+  }
+
+  alloc_counter_lib_enter();
   cairo_t *cr = eink_get_cairo(eink);
 
   // Reset canvas
   cairo_set_source_rgba(cr, 0, 0, 0, 0);
   cairo_paint(cr);
 
-  json_object *meta = parse_meta(meta_json);
-  cairo_render_meta(cr, meta, meta_keys, meta_keys_sz);
+  cairo_render_meta(cr, meta_ok ? values : NULL, meta_keys_sz);
   json_object_put(meta); // Free
   eink_render(eink);
+  alloc_counter_lib_exit();
 }
 
 
 atomic_bool g_user_intr = false;
-int g_img_render_pid = -1;
 struct AmbienceSvcConfig *g_cfg = NULL;
-struct ShmHandle *g_shm = NULL;
+struct Outputs *g_outputs = NULL;
 struct EInkDisplay *g_eink = NULL;
+struct AdaptiveRes *g_adaptive_res = NULL;
+struct MemArena *g_meta_arena = NULL;
+struct RevGeo *g_revgeo = NULL;
+struct SlideRecorder *g_recorder = NULL;
+struct PowerAcct *g_power = NULL;
+struct MemTrack *g_mem = NULL;
+struct PerfProf *g_perf = NULL;
+atomic_size_t g_slides_received = 0;
+
+// Print service stats every this many slides
+#define STATS_REPORT_EVERY_N_SLIDES 50
+
+// Latency tracking for the adaptive resolution mode: time at which the last
+// slide was requested, and fetch+publish time of the last received slide (0 if
+// no slide was received since the last request)
+atomic_uint_fast64_t g_slide_requested_ms = 0;
+atomic_size_t g_slide_latency_ms = 0;
 
 void handle_user_intr(int sig) { g_user_intr = true; }
 
+// Instrumentation around each stage of on_image_received. Each mode is a no-op
+// if disabled.
+static void stage_start(enum PipelineStage stage) {
+  mem_track_stage_start(g_mem, stage);
+  power_acct_stage_start(g_power, stage);
+  perf_prof_stage_start(g_perf, stage);
+}
+
+static void stage_end(enum PipelineStage stage) {
+  perf_prof_stage_end(g_perf, stage);
+  power_acct_stage_end(g_power, stage);
+  mem_track_stage_end(g_mem, stage);
+}
+
 void on_image_received(const void* img_ptr, size_t img_sz,
                        const char* meta_ptr, size_t meta_sz,
                        const void* qr_ptr, size_t qr_sz) {
+  const uint64_t fetch_ms = time_now_ms() - g_slide_requested_ms;
+  struct AllocCounters allocs_start;
+  alloc_counter_get(&allocs_start);
+  trace_event(TRACE_EV_SLIDE_RECEIVED, img_sz, meta_sz, qr_sz);
+
+  // Record before processing, so slides that crash the pipeline can be replayed
+  if (g_recorder) {
+    stage_start(PIPELINE_STAGE_RECORD);
+    if (slide_record_write(g_recorder, fetch_ms, img_ptr, img_sz, meta_ptr,
+                           meta_sz, qr_ptr, qr_sz) != 0) {
+      trace_log(stderr, "Failed to record slide\n");
+    }
+    stage_end(PIPELINE_STAGE_RECORD);
+  }
+
   if (g_cfg->image_request_metadata) {
-    eink_render_meta(g_eink, meta_ptr, g_cfg->image_metadata_keys, g_cfg->image_metadata_keys_count);
+    stage_start(PIPELINE_STAGE_META);
+    eink_render_meta(g_eink, g_meta_arena, g_revgeo, meta_ptr,
+                     g_cfg->image_metadata_keys,
+                     g_cfg->image_metadata_keys_count);
+    stage_end(PIPELINE_STAGE_META);
+  }
+
+  // Don't count the eInk refresh as part of the latency budget: it's slow and
+  // it doesn't depend on the image size
+  const uint64_t publish_start_ms = time_now_ms();
+  stage_start(PIPELINE_STAGE_PUBLISH);
+  outputs_publish(g_outputs, img_ptr, img_sz);
+  stage_end(PIPELINE_STAGE_PUBLISH);
+  g_slide_latency_ms = fetch_ms + (time_now_ms() - publish_start_ms);
+  g_slides_received++;
+  mem_track_on_slide(g_mem);
+  perf_prof_on_slide(g_perf);
+
+  if (alloc_counter_enabled()) {
+    struct AllocCounters allocs;
+    alloc_counter_get(&allocs);
+    const size_t owned = allocs.owned_allocs - allocs_start.owned_allocs;
+    trace_event(TRACE_EV_SLIDE_ALLOCS, owned,
+                allocs.lib_allocs - allocs_start.lib_allocs,
+                allocs.bytes - allocs_start.bytes);
+    // Libraries may still allocate, but we shouldn't
+    if (g_cfg->fixed_memory_mode &&
+        (g_slides_received > FIXED_MEMORY_WARMUP_SLIDES)) {
+      assert(owned == 0);
+    }
   }
+}
+
+void print_stats() {
+  printf("ambiencesvc stats after %zu slides:\n", (size_t)g_slides_received);
+  outputs_print_stats(g_outputs);
+  power_acct_print_stats(g_power);
+  mem_track_print_stats(g_mem);
+  perf_prof_print_stats(g_perf);
+}
 
-  if (shm_update(g_shm, img_ptr, img_sz) < 0) {
-    fprintf(stderr, "Failed to update shm with received image\n");
+static int cmp_u32(const void *a, const void *b) {
+  const uint32_t va = *(const uint32_t *)a;
+  const uint32_t vb = *(const uint32_t *)b;
+  return (va > vb) - (va < vb);
+}
+
+// Feed a recording through the pipeline instead of slides from the image
+// service, then report throughput and per slide latency (everything
+// on_image_received does). Unless fast is set, slides are spaced like they were
+// when recorded.
+bool replay_slides(const char *path, bool fast) {
+  struct SlideReplay *replay = slide_replay_open(path);
+  if (!replay) {
+    return false;
   }
 
-  g_img_render_pid = signal_single_kill_old(
-      SIGUSR1, g_cfg->image_render_proc_name, g_img_render_pid);
-  if (g_img_render_pid > 0) {
-    printf("Notified %s (pid %d) of new shm image\n",
-           g_cfg->image_render_proc_name, g_img_render_pid);
-  } else {
-    printf("Failed to notify %s of new shm image, can't find process\n",
-           g_cfg->image_render_proc_name);
+  // Count slides first, so there's no need to allocate while replaying
+  struct SlideRecord rec;
+  size_t n_slides = 0;
+  while (slide_replay_next(replay, &rec)) {
+    n_slides++;
+  }
+  slide_replay_rewind(replay);
+
+  uint32_t *lat_us = malloc(sizeof(uint32_t) * (n_slides ? n_slides : 1));
+  if (!lat_us) {
+    perror("Replay: bad alloc");
+    slide_replay_close(replay);
+    return false;
+  }
+
+  printf("Replaying %zu slides from %s%s\n", n_slides, path,
+         fast ? ", as fast as possible" : "");
+  size_t replayed = 0;
+  uint64_t fetch_ms_sum = 0;
+  uint32_t prev_session = 0;
+  uint64_t prev_session_ms = 0;
+  uint64_t prev_start_ms = 0;
+  const uint64_t replay_start_ns = time_now_ns();
+  while (!g_user_intr && (replayed < n_slides) &&
+         slide_replay_next(replay, &rec)) {
+    // A new session means the service restarted; don't wait for that
+    if (!fast && replayed && (rec.session == prev_session) &&
+        (rec.session_ms > prev_session_ms)) {
+      const uint64_t due_ms = prev_start_ms + (rec.session_ms - prev_session_ms);
+      const uint64_t now_ms = time_now_ms();
+      if (due_ms > now_ms) {
+        usleep((due_ms - now_ms) * 1000);
+      }
+    }
+    prev_session = rec.session;
+    prev_session_ms = rec.session_ms;
+    prev_start_ms = time_now_ms();
+
+    trace_event(TRACE_EV_SLIDE_REQUESTED, 0, 0, 0);
+    g_slide_requested_ms = time_now_ms();
+    const uint64_t start_ns = time_now_ns();
+    on_image_received(rec.img, rec.img_sz, rec.meta, rec.meta_sz, rec.qr,
+                      rec.qr_sz);
+    lat_us[replayed++] = (time_now_ns() - start_ns) / 1000;
+    power_acct_on_cycle(g_power);
+    fetch_ms_sum += rec.fetch_ms;
+  }
+
+  const double total_sec = (time_now_ns() - replay_start_ns) / 1e9;
+  printf("Replayed %zu slides in %.2f s (%.2f slides/s)\n", replayed,
+         total_sec, total_sec > 0 ? replayed / total_sec : 0);
+  if (replayed) {
+    qsort(lat_us, replayed, sizeof(uint32_t), cmp_u32);
+    printf("Slide latency, ms: p50=%.2f p90=%.2f p99=%.2f max=%.2f "
+           "(recorded fetch time avg=%.2f, not included)\n",
+           lat_us[replayed / 2] / 1e3, lat_us[replayed * 9 / 10] / 1e3,
+           lat_us[replayed * 99 / 100] / 1e3, lat_us[replayed - 1] / 1e3,
+           (double)fetch_ms_sum / replayed);
+  }
+
+  free(lat_us);
+  slide_replay_close(replay);
+  return true;
+}
+
+struct WwwSlider *wwwslider_start(size_t target_width, size_t target_height) {
+  struct WwwSliderConfig wcfg = {
+      .target_width = target_width,
+      .target_height = target_height,
+      .embed_qr = g_cfg->image_embed_qr,
+      .request_standalone_qr = g_cfg->image_request_standalone_qr,
+      .request_metadata = g_cfg->image_request_metadata,
+      .client_id = "uninitialized_client_id",
+      .on_image_available = on_image_received,
+  };
+  if (strlen(g_cfg->www_client_id) >= sizeof(wcfg.client_id)) {
+    fprintf(stderr, "Invalid client id %s, max len must be %zu\n",
+            g_cfg->www_client_id, sizeof(wcfg.client_id));
+    return NULL;
+  }
+  strncpy(wcfg.client_id, g_cfg->www_client_id, sizeof(wcfg.client_id));
+  struct WwwSlider *wwwslider = wwwslider_init(g_cfg->www_svc_url, wcfg);
+  if (!wwwslider || !wwwslider_wait_registered(wwwslider)) {
+    fprintf(stderr, "Fail to register with image service\n");
+    wwwslider_free(wwwslider);
+    return NULL;
   }
+
+  return wwwslider;
 }
 
 int main(int argc, const char **argv) {
   struct WwwSlider *wwwslider = NULL;
+  int ret = 0;
+
+  const char *cfg_fpath = "config.json";
+  const char *replay_path = NULL;
+  bool replay_fast = false;
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "--replay") == 0) && (i + 1 < argc)) {
+      replay_path = argv[++i];
+    } else if (strcmp(argv[i], "--fast") == 0) {
+      replay_fast = true;
+    } else if (argv[i][0] != '-') {
+      cfg_fpath = argv[i];
+    } else {
+      fprintf(stderr, "Usage: %s [config.json] [--replay recording [--fast]]\n",
+              argv[0]);
+      return 1;
+    }
+  }
 
-  const char *cfg_fpath = argc > 1 ? argv[1] : "config.json";
   if (!(g_cfg = ambiencesvc_config_init(cfg_fpath))) {
     goto err;
   }
@@ -152,9 +444,45 @@ int main(int argc, const char **argv) {
   printf("Startup ambiencesvc, config:\n");
   ambiencesvc_config_print(g_cfg);
 
-  if (!(g_shm = shm_init(g_cfg->shm_image_file_name,
-                         g_cfg->shm_image_max_size_bytes))) {
-    fprintf(stderr, "Can't initialize shm\n");
+  if (trace_init(g_cfg->trace_shm_file_name,
+                 g_cfg->log_max_lines_per_min) != 0) {
+    fprintf(stderr, "Can't initialize trace ring\n");
+    goto err;
+  }
+
+  // Before any thread is created, so the counters follow pipeline work to every
+  // thread
+  if (g_cfg->perf_profiling && !(g_perf = perf_prof_init())) {
+    fprintf(stderr, "Can't initialize perf profiling\n");
+    goto err;
+  }
+
+  if (!(g_outputs = outputs_init(g_cfg))) {
+    fprintf(stderr, "Can't initialize outputs\n");
+    goto err;
+  }
+
+  if (g_cfg->fixed_memory_mode) {
+    // Extra value for local_path
+    const size_t meta_sz =
+        (g_cfg->image_metadata_keys_count + 1) * (META_VALUE_MAX_SZ + 16);
+    if (!(g_meta_arena = mem_arena_init(meta_sz, true))) {
+      fprintf(stderr, "Can't reserve memory for metadata\n");
+      goto err;
+    }
+  }
+
+  if (g_cfg->revgeo_index_path &&
+      !(g_revgeo = revgeo_init(g_cfg->revgeo_index_path,
+                               g_cfg->revgeo_max_distance_km))) {
+    fprintf(stderr, "Can't load reverse geocoding index\n");
+    goto err;
+  }
+
+  // Don't record a replay into itself
+  if (g_cfg->record_slides_path && !replay_path &&
+      !(g_recorder = slide_record_open(g_cfg->record_slides_path))) {
+    fprintf(stderr, "Can't open slide recording\n");
     goto err;
   }
 
@@ -172,24 +500,39 @@ int main(int argc, const char **argv) {
   // enough
   // eink_quick_announce(g_eink, g_cfg->eink_hello_message, 36);
 
-  struct WwwSliderConfig wcfg = {
-      .target_width = g_cfg->image_target_width,
-      .target_height = g_cfg->image_target_height,
-      .embed_qr = g_cfg->image_embed_qr,
-      .request_standalone_qr = g_cfg->image_request_standalone_qr,
-      .request_metadata = g_cfg->image_request_metadata,
-      .client_id = "uninitialized_client_id",
-      .on_image_available = on_image_received,
-  };
-  if (strlen(g_cfg->www_client_id) >= sizeof(wcfg.client_id)) {
-    fprintf(stderr, "Invalid client id %s, max len must be %zu\n",
-            g_cfg->www_client_id, sizeof(wcfg.client_id));
+  size_t target_width = g_cfg->image_target_width;
+  size_t target_height = g_cfg->image_target_height;
+  if (g_cfg->adaptive_res_enable) {
+    g_adaptive_res = adaptive_res_init(
+        target_width, target_height, g_cfg->adaptive_res_min_width,
+        g_cfg->adaptive_res_min_height, g_cfg->adaptive_res_max_width,
+        g_cfg->adaptive_res_max_height, g_cfg->adaptive_res_latency_budget_ms);
+    if (!g_adaptive_res) {
+      fprintf(stderr, "Can't initialize adaptive resolution\n");
+      goto err;
+    }
+    adaptive_res_get(g_adaptive_res, &target_width, &target_height);
+  }
+
+  if (!replay_path &&
+      !(wwwslider = wwwslider_start(target_width, target_height))) {
     goto err;
   }
-  strncpy(wcfg.client_id, g_cfg->www_client_id, sizeof(wcfg.client_id));
-  wwwslider = wwwslider_init(g_cfg->www_svc_url, wcfg);
-  if (!wwwslider || !wwwslider_wait_registered(wwwslider)) {
-    fprintf(stderr, "Fail to register with image service\n");
+
+  if (g_cfg->fixed_memory_mode && (mlockall(MCL_CURRENT) != 0)) {
+    // Not fatal, buffers are fixed even if they may be swapped out
+    perror("Fixed memory mode: can't lock working set in RAM");
+  }
+
+  // Start accounting once setup is done, so its cost isn't blamed on slides
+  if (g_cfg->power_accounting &&
+      !(g_power = power_acct_init(g_cfg->power_budget_cpu_ms_per_slide,
+                                  g_cfg->power_budget_wakeups_per_hour))) {
+    fprintf(stderr, "Can't initialize power accounting\n");
+    goto err;
+  }
+  if (g_cfg->mem_tracking && !(g_mem = mem_track_init())) {
+    fprintf(stderr, "Can't initialize memory tracking\n");
     goto err;
   }
 
@@ -199,40 +542,75 @@ int main(int argc, const char **argv) {
     goto err;
   }
 
-  while (!g_user_intr) {
-    printf("Requesting next image\n");
+  if (replay_path && !replay_slides(replay_path, replay_fast)) {
+    ret = 1;
+  }
+
+  size_t stats_reported_at = 0;
+  while (!replay_path && !g_user_intr) {
+    trace_event(TRACE_EV_SLIDE_REQUESTED, 0, 0, 0);
+    trace_log(stdout, "Requesting next image\n");
+    g_slide_latency_ms = 0;
+    g_slide_requested_ms = time_now_ms();
     wwwslider_get_next_image(wwwslider);
     // TODO wwwslider_get_prev_image(wwwslider);
     sleep(g_cfg->slideshow_sleep_time_sec);
-  }
+    power_acct_on_cycle(g_power);
 
-  printf("Shutting down ambiencesvc...\n");
-  if (g_cfg->shm_leak_file) {
-    printf("Updating ambience image with %s\n", g_cfg->shm_leak_image_path);
-    if (shm_update_from_file(g_shm, g_cfg->shm_leak_image_path) <= 0) {
-      fprintf(stderr,
-              "Failed to update shm file with %s pre-shutdown, contents not "
-              "defined\n",
-              g_cfg->shm_leak_image_path);
+    if (g_slides_received >= stats_reported_at + STATS_REPORT_EVERY_N_SLIDES) {
+      stats_reported_at = g_slides_received;
+      print_stats();
+    }
+
+    // The requested size is part of the registration with the image service,
+    // so a new size means a new wwwslider
+    const size_t latency_ms = g_slide_latency_ms;
+    if (g_adaptive_res && (latency_ms > 0) &&
+        adaptive_res_on_slide(g_adaptive_res, latency_ms)) {
+      adaptive_res_get(g_adaptive_res, &target_width, &target_height);
+      wwwslider_free(wwwslider);
+      if (!(wwwslider = wwwslider_start(target_width, target_height))) {
+        fprintf(stderr, "Can't restart image service client with new target "
+                        "size, shutting down\n");
+        break;
+      }
     }
-    shm_free_leak_shm(g_shm);
-  } else {
-    shm_free(g_shm);
   }
 
+  printf("Shutting down ambiencesvc...\n");
+  print_stats();
+  outputs_free(g_outputs,
+               g_cfg->shm_leak_file ? g_cfg->shm_leak_image_path : NULL);
+
   printf("eInk announce: %s\n", g_cfg->eink_goodbye_message);
   eink_quick_announce(g_eink, g_cfg->eink_goodbye_message, 36);
 
   ambiencesvc_config_free(g_cfg);
   wwwslider_free(wwwslider);
   eink_delete(g_eink);
-  return 0;
+  adaptive_res_free(g_adaptive_res);
+  mem_arena_free(g_meta_arena);
+  revgeo_free(g_revgeo);
+  slide_record_close(g_recorder);
+  power_acct_free(g_power);
+  mem_track_free(g_mem);
+  perf_prof_free(g_perf);
+  trace_free();
+  return ret;
 
 err:
   fprintf(stderr, "Fail to start ambience service\n");
   wwwslider_free(wwwslider);
-  shm_free(g_shm);
+  outputs_free(g_outputs, NULL);
   ambiencesvc_config_free(g_cfg);
   eink_delete(g_eink);
+  adaptive_res_free(g_adaptive_res);
+  mem_arena_free(g_meta_arena);
+  revgeo_free(g_revgeo);
+  slide_record_close(g_recorder);
+  power_acct_free(g_power);
+  mem_track_free(g_mem);
+  perf_prof_free(g_perf);
+  trace_free();
   return 1;
 }
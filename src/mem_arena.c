@@ -0,0 +1,74 @@
+#include "mem_arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define ARENA_ALIGN 16
+
+struct MemArena {
+  unsigned char *base;
+  size_t sz;
+  size_t used;
+  bool locked;
+};
+
+struct MemArena *mem_arena_init(size_t sz, bool lock) {
+  struct MemArena *h = malloc(sizeof(struct MemArena));
+  if (!h) {
+    perror("mem_arena: bad alloc");
+    return NULL;
+  }
+
+  h->sz = sz;
+  h->used = 0;
+  h->locked = false;
+  // Populate now, so no page faults happen later in the steady state
+  h->base = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+  if (h->base == MAP_FAILED) {
+    perror("mem_arena: can't reserve memory");
+    free(h);
+    return NULL;
+  }
+
+  if (lock) {
+    if (mlock(h->base, sz) == 0) {
+      h->locked = true;
+    } else {
+      // Not fatal: we still get a fixed footprint, it just may be swapped
+      perror("mem_arena: can't lock memory, will continue unlocked");
+    }
+  }
+
+  return h;
+}
+
+void mem_arena_free(struct MemArena *h) {
+  if (!h) {
+    return;
+  }
+
+  if (h->locked) {
+    munlock(h->base, h->sz);
+  }
+  munmap(h->base, h->sz);
+  free(h);
+}
+
+void *mem_arena_alloc(struct MemArena *h, size_t sz) {
+  const size_t start = (h->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if ((start > h->sz) || (sz > h->sz - start)) {
+    return NULL;
+  }
+
+  h->used = start + sz;
+  return h->base + start;
+}
+
+size_t mem_arena_available(const struct MemArena *h) {
+  const size_t start = (h->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  return start < h->sz ? h->sz - start : 0;
+}
+
+void mem_arena_reset(struct MemArena *h) { h->used = 0; }
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Fixed size bump allocator. All memory is reserved (and optionally locked in
+// RAM) on init; allocations never touch the heap, and are released all at once
+// with mem_arena_reset.
+struct MemArena;
+
+struct MemArena *mem_arena_init(size_t sz, bool lock);
+void mem_arena_free(struct MemArena *h);
+
+// Returns NULL if the arena doesn't have space for sz more bytes
+void *mem_arena_alloc(struct MemArena *h, size_t sz);
+
+// Size of the biggest allocation that can still succeed
+size_t mem_arena_available(const struct MemArena *h);
+
+// Release all allocations
+void mem_arena_reset(struct MemArena *h);
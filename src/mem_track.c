@@ -0,0 +1,248 @@
+#include "mem_track.h"
+
+#include "alloc_counter.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Enough for /proc/self/status and smaps_rollup
+#define PROC_READ_BUF_SZ 4096
+// Resets VmHWM to the current RSS, see proc(5)
+#define CLEAR_REFS_RESET_HWM "5"
+
+struct MemStageStats {
+  atomic_size_t runs;
+  atomic_size_t max_peak_rss_kb;
+  // RSS when the stage last ended
+  atomic_size_t rss_kb;
+  // Sum of RSS growth over all runs, may be negative
+  atomic_int_fast64_t rss_growth_kb;
+  atomic_size_t max_peak_heap;
+  // Heap bytes the stage allocated and didn't free, last run
+  atomic_int_fast64_t heap_retained;
+};
+
+struct MemTrack {
+  int statm_fd;
+  int status_fd;
+  int smaps_rollup_fd;
+  int clear_refs_fd;
+  size_t page_kb;
+
+  // Only used by the thread running the pipeline
+  size_t stage_start_rss_kb;
+  size_t stage_start_heap;
+  size_t slide_peak_rss_kb;
+
+  // Written by the pipeline, read by print_stats
+  struct MemStageStats stages[PIPELINE_STAGE_COUNT];
+  atomic_size_t rss_kb;
+  atomic_size_t pss_kb;
+  atomic_size_t max_rss_kb;
+  atomic_size_t max_pss_kb;
+};
+
+static void max_update(atomic_size_t *max, size_t v) {
+  if (v > *max) {
+    *max = v;
+  }
+}
+
+// Read a /proc file from the start, without stdio so it doesn't allocate
+static bool proc_read(int fd, char *buf, size_t buf_sz) {
+  if (fd < 0) {
+    return false;
+  }
+  const ssize_t n = pread(fd, buf, buf_sz - 1, 0);
+  if (n <= 0) {
+    return false;
+  }
+  buf[n] = '\0';
+  return true;
+}
+
+// Value of a "Key:   123 kB" line, 0 if not found
+static size_t proc_get_kb(const char *buf, const char *key) {
+  const size_t key_len = strlen(key);
+  for (const char *ln = buf; ln; ln = strchr(ln, '\n')) {
+    ln += (*ln == '\n');
+    if ((strncmp(ln, key, key_len) == 0) && (ln[key_len] == ':')) {
+      return strtoull(ln + key_len + 1, NULL, 10);
+    }
+  }
+  return 0;
+}
+
+static size_t mem_track_rss_kb(struct MemTrack *h) {
+  char buf[128];
+  if (!proc_read(h->statm_fd, buf, sizeof(buf))) {
+    return 0;
+  }
+  // Second field is resident pages
+  const char *resident = strchr(buf, ' ');
+  return resident ? strtoull(resident + 1, NULL, 10) * h->page_kb : 0;
+}
+
+static size_t mem_track_hwm_kb(struct MemTrack *h) {
+  char buf[PROC_READ_BUF_SZ];
+  return proc_read(h->status_fd, buf, sizeof(buf)) ? proc_get_kb(buf, "VmHWM")
+                                                    : 0;
+}
+
+static bool mem_track_reset_hwm(struct MemTrack *h) {
+  return (h->clear_refs_fd >= 0) &&
+         (pwrite(h->clear_refs_fd, CLEAR_REFS_RESET_HWM,
+                 strlen(CLEAR_REFS_RESET_HWM), 0) > 0);
+}
+
+struct MemTrack *mem_track_init(void) {
+  struct MemTrack *h = malloc(sizeof(struct MemTrack));
+  if (!h) {
+    perror("mem_track: bad alloc");
+    return NULL;
+  }
+
+  memset(h, 0, sizeof(struct MemTrack));
+  h->smaps_rollup_fd = h->clear_refs_fd = -1;
+  h->page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  h->statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+  h->status_fd = open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+  if ((h->statm_fd < 0) || (h->status_fd < 0)) {
+    perror("mem_track: can't open /proc/self");
+    goto err;
+  }
+
+  // Optional, may not be supported by the kernel or allowed in a container
+  h->smaps_rollup_fd = open("/proc/self/smaps_rollup", O_RDONLY | O_CLOEXEC);
+  h->clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  if (!mem_track_reset_hwm(h)) {
+    printf("mem_track: can't reset VmHWM, stage peaks will be sampled\n");
+    if (h->clear_refs_fd >= 0) {
+      close(h->clear_refs_fd);
+      h->clear_refs_fd = -1;
+    }
+  }
+  if (h->smaps_rollup_fd < 0) {
+    printf("mem_track: no smaps_rollup, PSS won't be available\n");
+  }
+
+  return h;
+
+err:
+  mem_track_free(h);
+  return NULL;
+}
+
+void mem_track_free(struct MemTrack *h) {
+  if (!h) {
+    return;
+  }
+
+  const int fds[] = {h->statm_fd, h->status_fd, h->smaps_rollup_fd,
+                     h->clear_refs_fd};
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); ++i) {
+    if (fds[i] >= 0) {
+      close(fds[i]);
+    }
+  }
+  free(h);
+}
+
+void mem_track_stage_start(struct MemTrack *h, enum PipelineStage stage) {
+  if (!h) {
+    return;
+  }
+
+  mem_track_reset_hwm(h);
+  h->stage_start_rss_kb = mem_track_rss_kb(h);
+  struct AllocCounters allocs;
+  alloc_counter_get(&allocs);
+  h->stage_start_heap = allocs.live_bytes;
+  alloc_counter_reset_peak();
+}
+
+void mem_track_stage_end(struct MemTrack *h, enum PipelineStage stage) {
+  if (!h || (stage >= PIPELINE_STAGE_COUNT)) {
+    return;
+  }
+
+  const size_t rss_kb = mem_track_rss_kb(h);
+  size_t peak_kb = rss_kb > h->stage_start_rss_kb ? rss_kb
+                                                  : h->stage_start_rss_kb;
+  if (h->clear_refs_fd >= 0) {
+    const size_t hwm_kb = mem_track_hwm_kb(h);
+    peak_kb = hwm_kb > peak_kb ? hwm_kb : peak_kb;
+  }
+  struct AllocCounters allocs;
+  alloc_counter_get(&allocs);
+  const size_t peak_heap = allocs.peak_live_bytes - h->stage_start_heap;
+
+  struct MemStageStats *s = &h->stages[stage];
+  if ((s->runs > 0) && (peak_kb > s->max_peak_rss_kb)) {
+    trace_log(stdout, "Memory: new peak RSS of %zu kB in stage %s\n", peak_kb,
+              pipeline_stage_name(stage));
+  }
+  max_update(&s->max_peak_rss_kb, peak_kb);
+  max_update(&s->max_peak_heap, peak_heap);
+  s->rss_kb = rss_kb;
+  s->rss_growth_kb += (int64_t)rss_kb - (int64_t)h->stage_start_rss_kb;
+  s->heap_retained = (int64_t)allocs.live_bytes - (int64_t)h->stage_start_heap;
+  s->runs++;
+  trace_event(TRACE_EV_STAGE_MEM, stage, peak_kb, peak_heap);
+
+  if (peak_kb > h->slide_peak_rss_kb) {
+    h->slide_peak_rss_kb = peak_kb;
+  }
+}
+
+void mem_track_on_slide(struct MemTrack *h) {
+  if (!h) {
+    return;
+  }
+
+  char buf[PROC_READ_BUF_SZ];
+  const size_t pss_kb = proc_read(h->smaps_rollup_fd, buf, sizeof(buf))
+                            ? proc_get_kb(buf, "Pss")
+                            : 0;
+  const size_t rss_kb = mem_track_rss_kb(h);
+  h->pss_kb = pss_kb;
+  h->rss_kb = rss_kb;
+  max_update(&h->max_pss_kb, pss_kb);
+  max_update(&h->max_rss_kb, h->slide_peak_rss_kb);
+  trace_event(TRACE_EV_SLIDE_MEM, pss_kb, rss_kb, h->slide_peak_rss_kb);
+  h->slide_peak_rss_kb = 0;
+}
+
+void mem_track_print_stats(struct MemTrack *h) {
+  if (!h) {
+    return;
+  }
+
+  printf("\tmemory: rss=%zu kB, pss=%zu kB, peak rss=%zu kB, peak pss=%zu kB\n",
+         (size_t)h->rss_kb, (size_t)h->pss_kb, (size_t)h->max_rss_kb,
+         (size_t)h->max_pss_kb);
+  for (size_t i = 0; i < PIPELINE_STAGE_COUNT; ++i) {
+    const struct MemStageStats *s = &h->stages[i];
+    const size_t runs = s->runs;
+    if (runs == 0) {
+      continue;
+    }
+    printf("\tmemory[%s]: peak rss=%zu kB, rss after=%zu kB, avg rss "
+           "growth=%.1f kB",
+           pipeline_stage_name(i), (size_t)s->max_peak_rss_kb,
+           (size_t)s->rss_kb, (double)s->rss_growth_kb / runs);
+    if (alloc_counter_enabled()) {
+      printf(", peak heap=%zu B, heap retained=%" PRId64 " B",
+             (size_t)s->max_peak_heap, (int64_t)s->heap_retained);
+    }
+    printf("\n");
+  }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "pipeline_stage.h"
+
+// Tracks the memory footprint of the service around each pipeline stage: RSS
+// when the stage ends (its steady state), and the peak RSS while it ran. The
+// peak comes from VmHWM, which is reset at the start of each stage through
+// /proc/self/clear_refs; if that isn't allowed, the peak is only sampled at the
+// start and end of the stage. PSS (which splits shared pages, like the shm
+// areas, between the processes mapping them) is sampled once per slide.
+//
+// When built with ALLOC_COUNTER, the peak and retained heap bytes of each stage
+// are tracked too.
+//
+// Sampling doesn't allocate, so it can be used in fixed memory mode. All
+// functions are no-ops if h is NULL.
+struct MemTrack;
+
+struct MemTrack *mem_track_init(void);
+void mem_track_free(struct MemTrack *h);
+
+// Stages can't be nested
+void mem_track_stage_start(struct MemTrack *h, enum PipelineStage stage);
+void mem_track_stage_end(struct MemTrack *h, enum PipelineStage stage);
+
+// Call once all stages of a slide ran
+void mem_track_on_slide(struct MemTrack *h);
+
+void mem_track_print_stats(struct MemTrack *h);
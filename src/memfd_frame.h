@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+
+// Protocol for consumers of sealed memfd frames (see memfd_pub.h). This is an
+// alternative to the /dev/shm image: each frame is a new memfd, filled and then
+// sealed against writes and resizes before it's shared, so a consumer can mmap
+// it read-only and use it directly, without copies or re-validation.
+//
+// Consumer protocol:
+//   1. Connect a SOCK_SEQPACKET unix socket to the output's memfd_socket_path.
+//      New connections are picked up whenever a frame is published, and
+//      that frame is the first one sent to them.
+//   2. Each message is one struct MemfdFrameMsg, with the frame's fd attached
+//      as SCM_RIGHTS ancillary data. Check magic and version, then mmap sz
+//      bytes of the fd with PROT_READ and MAP_PRIVATE or MAP_SHARED.
+//   3. Close the fd (and munmap) when done with a frame; the memory is released
+//      once every consumer is done with it.
+//   4. A consumer that doesn't read its socket fast enough will miss frames
+//      (the publisher never blocks); seq has gaps when that happens.
+//
+// Seals on every frame: F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW |
+// F_SEAL_SEAL. Consumers may verify them with fcntl(fd, F_GET_SEALS).
+
+#define MEMFD_FRAME_MAGIC 0x46444d41 // "AMDF"
+#define MEMFD_FRAME_VERSION 1
+
+struct MemfdFrameMsg {
+  uint32_t magic;
+  uint32_t version;
+  // Incremented for every frame published
+  uint32_t seq;
+  // Size of the frame (a JPEG image); same as the memfd size
+  uint32_t sz;
+};
@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+#include "memfd_pub.h"
+#include "memfd_frame.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define MEMFD_MAX_CONSUMERS 4
+#define MEMFD_SEALS (F_SEAL_WRITE | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL)
+
+struct MemfdPub {
+  const char *socket_path;
+  int listen_fd;
+  int consumers[MEMFD_MAX_CONSUMERS];
+
+  // Last published frame, for consumers that connect after it was published
+  int frame_fd;
+  struct MemfdFrameMsg frame_msg;
+  struct MemfdPubStats stats;
+};
+
+static void memfd_pub_drop_consumer(struct MemfdPub *h, size_t i) {
+  close(h->consumers[i]);
+  h->consumers[i] = -1;
+  h->stats.consumers_connected--;
+}
+
+void memfd_pub_free(struct MemfdPub *h) {
+  if (!h) {
+    return;
+  }
+
+  for (size_t i = 0; i < MEMFD_MAX_CONSUMERS; ++i) {
+    if (h->consumers[i] >= 0) {
+      memfd_pub_drop_consumer(h, i);
+    }
+  }
+
+  if (h->frame_fd >= 0) {
+    close(h->frame_fd);
+  }
+
+  if (h->listen_fd >= 0) {
+    close(h->listen_fd);
+    unlink(h->socket_path);
+  }
+
+  free((void *)h->socket_path);
+  free(h);
+}
+
+struct MemfdPub *memfd_pub_init(const char *socket_path) {
+  struct MemfdPub *h = malloc(sizeof(struct MemfdPub));
+  if (!h) {
+    perror("memfd_pub: bad alloc");
+    return NULL;
+  }
+
+  memset(h, 0, sizeof(struct MemfdPub));
+  h->listen_fd = -1;
+  h->frame_fd = -1;
+  for (size_t i = 0; i < MEMFD_MAX_CONSUMERS; ++i) {
+    h->consumers[i] = -1;
+  }
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "memfd_pub: socket path too long: %s\n", socket_path);
+    goto err;
+  }
+  strcpy(addr.sun_path, socket_path);
+
+  h->socket_path = strdup(socket_path);
+  if (!h->socket_path) {
+    perror("memfd_pub: bad alloc");
+    goto err;
+  }
+
+  h->listen_fd =
+      socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (h->listen_fd < 0) {
+    perror("memfd_pub: can't create socket");
+    goto err;
+  }
+
+  // A previous instance may have left its socket behind
+  unlink(socket_path);
+  if (bind(h->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    perror("memfd_pub: can't bind socket");
+    goto err;
+  }
+
+  // Same permissions as the shm image: any local process may read frames
+  chmod(socket_path, 0666);
+  if (listen(h->listen_fd, MEMFD_MAX_CONSUMERS) < 0) {
+    perror("memfd_pub: can't listen on socket");
+    goto err;
+  }
+
+  return h;
+
+err:
+  memfd_pub_free(h);
+  return NULL;
+}
+
+// Send a frame to a consumer. Returns false if the consumer is gone.
+static bool memfd_pub_send(struct MemfdPub *h, size_t i) {
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  memset(cbuf, 0, sizeof(cbuf));
+  struct iovec iov = {.iov_base = &h->frame_msg, .iov_len = sizeof(h->frame_msg)};
+  struct msghdr msg = {.msg_name = NULL,
+                       .msg_namelen = 0,
+                       .msg_iov = &iov,
+                       .msg_iovlen = 1,
+                       .msg_control = cbuf,
+                       .msg_controllen = sizeof(cbuf),
+                       .msg_flags = 0};
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &h->frame_fd, sizeof(int));
+
+  if (sendmsg(h->consumers[i], &msg, MSG_DONTWAIT | MSG_NOSIGNAL) >= 0) {
+    return true;
+  }
+
+  if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+    // Consumer is busy, it'll get a newer frame
+    h->stats.frames_dropped++;
+    return true;
+  }
+
+  return false;
+}
+
+static void memfd_pub_accept(struct MemfdPub *h) {
+  while (true) {
+    int fd = accept4(h->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+      if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+        perror("memfd_pub: can't accept consumer");
+      }
+      return;
+    }
+
+    size_t slot = MEMFD_MAX_CONSUMERS;
+    for (size_t i = 0; i < MEMFD_MAX_CONSUMERS; ++i) {
+      if (h->consumers[i] < 0) {
+        slot = i;
+        break;
+      }
+    }
+
+    if (slot == MEMFD_MAX_CONSUMERS) {
+      fprintf(stderr, "memfd_pub: too many consumers on %s, rejecting\n",
+              h->socket_path);
+      close(fd);
+      continue;
+    }
+
+    h->consumers[slot] = fd;
+    h->stats.consumers_connected++;
+    if ((h->frame_fd >= 0) && !memfd_pub_send(h, slot)) {
+      memfd_pub_drop_consumer(h, slot);
+    }
+  }
+}
+
+static int memfd_pub_new_frame(const void *data, size_t sz) {
+  int fd = memfd_create("ambience_frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0) {
+    perror("memfd_pub: can't create memfd");
+    return -errno;
+  }
+
+  // write() instead of mmap: F_SEAL_WRITE fails while a writable mapping exists
+  if (ftruncate(fd, sz) < 0) {
+    perror("memfd_pub: can't resize memfd");
+    goto err;
+  }
+
+  const char *p = data;
+  size_t left = sz;
+  while (left > 0) {
+    const ssize_t n = write(fd, p, left);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("memfd_pub: can't write memfd");
+      goto err;
+    }
+    p += n;
+    left -= n;
+  }
+
+  if (fcntl(fd, F_ADD_SEALS, MEMFD_SEALS) < 0) {
+    perror("memfd_pub: can't seal memfd");
+    goto err;
+  }
+
+  return fd;
+
+err:
+  close(fd);
+  return -EIO;
+}
+
+int memfd_pub_publish(struct MemfdPub *h, const void *data, size_t sz) {
+  if (sz > UINT32_MAX) {
+    return -EINVAL;
+  }
+
+  const int fd = memfd_pub_new_frame(data, sz);
+  if (fd < 0) {
+    return fd;
+  }
+
+  // The previous frame stays alive for as long as consumers hold it
+  if (h->frame_fd >= 0) {
+    close(h->frame_fd);
+  }
+  h->frame_fd = fd;
+  h->frame_msg.magic = MEMFD_FRAME_MAGIC;
+  h->frame_msg.version = MEMFD_FRAME_VERSION;
+  h->frame_msg.seq++;
+  h->frame_msg.sz = sz;
+  h->stats.frames_published++;
+
+  for (size_t i = 0; i < MEMFD_MAX_CONSUMERS; ++i) {
+    if ((h->consumers[i] >= 0) && !memfd_pub_send(h, i)) {
+      fprintf(stderr, "memfd_pub: consumer of %s is gone\n", h->socket_path);
+      memfd_pub_drop_consumer(h, i);
+    }
+  }
+
+  // New consumers get this frame as soon as they're accepted
+  memfd_pub_accept(h);
+  return 0;
+}
+
+void memfd_pub_get_stats(struct MemfdPub *h, struct MemfdPubStats *out) {
+  *out = h->stats;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+// Publish frames as sealed memfds, passed to consumers connected to a unix
+// socket. See memfd_frame.h for the consumer side.
+struct MemfdPub;
+
+struct MemfdPubStats {
+  size_t frames_published;
+  size_t consumers_connected;
+  // Frames a consumer didn't get because its socket was full
+  size_t frames_dropped;
+};
+
+// Listens on socket_path, replacing any stale socket left there
+struct MemfdPub *memfd_pub_init(const char *socket_path);
+void memfd_pub_free(struct MemfdPub *h);
+
+// Copy sz bytes from data to a new sealed memfd, and send it to every connected
+// consumer. Never blocks on consumers. Also accepts new consumers.
+// Returns 0 on success (even if there are no consumers), an error code in any
+// other case
+int memfd_pub_publish(struct MemfdPub *h, const void *data, size_t sz);
+
+void memfd_pub_get_stats(struct MemfdPub *h, struct MemfdPubStats *out);
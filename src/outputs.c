@@ -0,0 +1,593 @@
+#include "outputs.h"
+#include "color_lut.h"
+#include "config.h"
+#include "jpeg_resize.h"
+#include "mem_arena.h"
+#include "memfd_pub.h"
+#include "proc_utils.h"
+#include "shm.h"
+#include "trace.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define OUTPUT_JPEG_QUALITY 90
+// Slack for arena alignment
+#define ARENA_SLACK_BYTES 64
+// Outside of fixed memory mode, images that would decode to more than this many
+// times the biggest output are streamed instead. DCT scaling alone can leave a
+// decoded image up to 2x bigger than needed in each dimension, so anything
+// beyond that is an image we'd otherwise be holding in memory for no reason.
+#define MAX_DECODE_OUTPUT_RATIO 4
+// Publish workers only run our resize/encode code and libjpeg, which need
+// little stack. Keep it small, since fixed memory mode locks it in RAM.
+#define WORKER_STACK_SZ (512 * 1024)
+
+struct Output {
+  const struct AmbienceSvcOutput *cfg;
+  struct ShmHandle *shm;
+  // NULL if this output doesn't publish memfds
+  struct MemfdPub *memfd;
+  int render_pid;
+  // Set per publish: the received image must be decoded for this output,
+  // because it's too big or because it needs the colour LUT applied
+  bool needs_resize;
+  // Set per publish: the received image can't go through the shared decode (or
+  // is too big for shm as is) and will be downscaled on the fly
+  bool needs_stream;
+  // Fixed memory mode: resized and encoded images for this output
+  struct MemArena *arena;
+};
+
+struct Outputs {
+  struct Output *outs;
+  size_t count;
+  size_t shm_max_sz;
+  // Biggest image we're willing to decode in full
+  size_t max_decode_sz;
+
+  // State of the image being published, shared by all workers
+  const void *img;
+  size_t img_sz;
+  struct RgbImage decoded;
+  atomic_size_t next_output;
+
+  // Worker pool, created once. The thread calling outputs_publish is a worker
+  // too, so there are at most count - 1 of these.
+  pthread_t *workers;
+  size_t n_workers;
+  pthread_mutex_t pool_lock;
+  // Signaled when a new image is ready to publish, or on shutdown
+  pthread_cond_t work_ready;
+  // Signaled when the last busy worker is done
+  pthread_cond_t work_done;
+  // Incremented for each image published
+  uint64_t work_generation;
+  size_t workers_busy;
+  bool workers_stop;
+
+  // Fixed memory mode: decoded image
+  struct MemArena *decode_arena;
+
+  // Time of day adjustments. The LUT is only rebuilt when the active schedule
+  // entry changes, and is skipped altogether if it's a no-op.
+  const struct AmbienceScheduleEntry *schedule;
+  size_t schedule_count;
+  size_t schedule_active;
+  struct ColorLut lut;
+  bool lut_enabled;
+};
+
+static void outputs_start_workers(struct Outputs *h);
+static void outputs_stop_workers(struct Outputs *h);
+
+static bool outputs_init_arenas(struct Outputs *h,
+                                const struct AmbienceSvcConfig *cfg) {
+  // Images shouldn't be bigger than what we request, and the biggest request
+  // we'll make depends on the adaptive resolution mode
+  const size_t max_w = cfg->adaptive_res_enable ? cfg->adaptive_res_max_width
+                                                : cfg->image_target_width;
+  const size_t max_h = cfg->adaptive_res_enable ? cfg->adaptive_res_max_height
+                                                : cfg->image_target_height;
+  size_t total_sz = max_w * max_h * 3;
+  h->decode_arena = mem_arena_init(max_w * max_h * 3, true);
+  if (!h->decode_arena) {
+    return false;
+  }
+  h->max_decode_sz = max_w * max_h * 3;
+
+  for (size_t i = 0; i < h->count; ++i) {
+    // Resized image, plus space to encode it. A JPEG is (nearly) always
+    // smaller than the raw image.
+    struct Output *out = &h->outs[i];
+    const size_t sz = 2 * out->cfg->width * out->cfg->height * 3;
+    out->arena = mem_arena_init(sz + ARENA_SLACK_BYTES, true);
+    if (!out->arena) {
+      return false;
+    }
+    total_sz += sz;
+  }
+
+  printf("outputs: reserved %zu KB for image buffers\n", total_sz / 1024);
+  return true;
+}
+
+struct Outputs *outputs_init(const struct AmbienceSvcConfig *cfg) {
+  const struct AmbienceSvcOutput *cfgs = cfg->outputs;
+  const size_t count = cfg->outputs_count;
+  struct Outputs *h = malloc(sizeof(struct Outputs));
+  if (!h) {
+    perror("outputs: bad alloc");
+    return NULL;
+  }
+
+  memset(h, 0, sizeof(struct Outputs));
+  pthread_mutex_init(&h->pool_lock, NULL);
+  pthread_cond_init(&h->work_ready, NULL);
+  pthread_cond_init(&h->work_done, NULL);
+  h->outs = malloc(sizeof(struct Output) * count);
+  if (!h->outs) {
+    perror("outputs: bad alloc");
+    goto err;
+  }
+
+  h->count = count;
+  h->shm_max_sz = cfg->shm_image_max_size_bytes;
+  h->schedule = cfg->ambience_schedule;
+  h->schedule_count = cfg->ambience_schedule_count;
+  h->schedule_active = SIZE_MAX;
+  h->lut_enabled = false;
+  h->max_decode_sz = 0;
+  for (size_t i = 0; i < count; ++i) {
+    h->outs[i].cfg = &cfgs[i];
+    h->outs[i].render_pid = -1;
+    h->outs[i].needs_resize = false;
+    h->outs[i].needs_stream = false;
+    const size_t out_sz = cfgs[i].width * cfgs[i].height * 3;
+    if (out_sz * MAX_DECODE_OUTPUT_RATIO > h->max_decode_sz) {
+      h->max_decode_sz = out_sz * MAX_DECODE_OUTPUT_RATIO;
+    }
+    h->outs[i].shm = NULL;
+    h->outs[i].memfd = NULL;
+    h->outs[i].arena = NULL;
+  }
+
+  if (cfg->fixed_memory_mode && !outputs_init_arenas(h, cfg)) {
+    fprintf(stderr, "outputs: can't reserve memory for fixed memory mode\n");
+    goto err;
+  }
+
+  for (size_t i = 0; i < count; ++i) {
+    h->outs[i].shm = shm_init(cfgs[i].shm_image_file_name,
+                              cfg->shm_image_max_size_bytes,
+                              cfg->shm_warm_start);
+    if (!h->outs[i].shm) {
+      fprintf(stderr, "outputs: can't initialize shm for output %zu (%s)\n", i,
+              cfgs[i].shm_image_file_name);
+      goto err;
+    }
+
+    if (cfgs[i].memfd_socket_path) {
+      h->outs[i].memfd = memfd_pub_init(cfgs[i].memfd_socket_path);
+      if (!h->outs[i].memfd) {
+        fprintf(stderr, "outputs: can't publish memfds for output %zu (%s)\n",
+                i, cfgs[i].memfd_socket_path);
+        goto err;
+      }
+    }
+  }
+
+  outputs_start_workers(h);
+  return h;
+
+err:
+  outputs_free(h, NULL);
+  return NULL;
+}
+
+void outputs_free(struct Outputs *h, const char *leak_image_path) {
+  if (!h) {
+    return;
+  }
+
+  outputs_stop_workers(h);
+  pthread_cond_destroy(&h->work_done);
+  pthread_cond_destroy(&h->work_ready);
+  pthread_mutex_destroy(&h->pool_lock);
+  mem_arena_free(h->decode_arena);
+  for (size_t i = 0; h->outs && i < h->count; ++i) {
+    struct Output *out = &h->outs[i];
+    mem_arena_free(out->arena);
+    memfd_pub_free(out->memfd);
+    if (!out->shm) {
+      continue;
+    }
+
+    if (!leak_image_path) {
+      shm_free(out->shm);
+      continue;
+    }
+
+    printf("Updating ambience image %s with %s\n",
+           out->cfg->shm_image_file_name, leak_image_path);
+    if (shm_update_from_file(out->shm, leak_image_path) <= 0) {
+      fprintf(stderr,
+              "Failed to update shm file %s with %s pre-shutdown, contents "
+              "not defined\n",
+              out->cfg->shm_image_file_name, leak_image_path);
+    }
+    shm_free_leak_shm(out->shm);
+  }
+
+  free(h->outs);
+  free(h);
+}
+
+// Send a frame through every transport this output uses. Only the shm result
+// counts: memfd consumers are optional extras.
+static int output_publish_frame(struct Outputs *h, struct Output *out,
+                                const void *frame, size_t sz) {
+  const size_t out_idx = out - h->outs;
+  const int ret = shm_update(out->shm, frame, sz);
+  trace_event(ret < 0 ? TRACE_EV_SHM_PUBLISH_FAILED : TRACE_EV_SHM_PUBLISHED,
+              sz, out_idx, 0);
+
+  if (out->memfd) {
+    struct MemfdPubStats stats;
+    const int memfd_ret = memfd_pub_publish(out->memfd, frame, sz);
+    memfd_pub_get_stats(out->memfd, &stats);
+    if (memfd_ret < 0) {
+      trace_event(TRACE_EV_MEMFD_PUBLISH_FAILED, sz, out_idx, 0);
+      trace_log(stderr, "Failed to publish memfd frame for %s\n",
+                out->cfg->memfd_socket_path);
+    } else {
+      trace_event(TRACE_EV_MEMFD_PUBLISHED, sz, out_idx,
+                  stats.consumers_connected);
+    }
+  }
+
+  return ret;
+}
+
+static int output_publish_resized(struct Outputs *h, struct Output *out) {
+  struct RgbImage resized;
+  rgb_image_fit_size(&h->decoded, out->cfg->width, out->cfg->height,
+                     &resized.width, &resized.height);
+  const size_t resized_sz = resized.width * resized.height * 3;
+  resized.px = out->arena ? mem_arena_alloc(out->arena, resized_sz) : NULL;
+  resized.px_owned = !resized.px;
+  if (!resized.px) {
+    resized.px = malloc(resized_sz);
+  }
+  if (!resized.px) {
+    fprintf(stderr, "outputs: can't alloc %zux%zu image\n", resized.width,
+            resized.height);
+    return -1;
+  }
+  rgb_image_resize(&h->decoded, &resized);
+  if (h->lut_enabled) {
+    color_lut_apply(&h->lut, resized.px, resized.width * resized.height);
+  }
+
+  size_t jpeg_buf_sz = out->arena ? mem_arena_available(out->arena) : 0;
+  unsigned char *jpeg_buf =
+      jpeg_buf_sz ? mem_arena_alloc(out->arena, jpeg_buf_sz) : NULL;
+  unsigned char *jpeg = jpeg_buf;
+  size_t jpeg_sz = jpeg_buf_sz;
+  int ret = jpeg_encode(&resized, OUTPUT_JPEG_QUALITY, &jpeg, &jpeg_sz);
+  rgb_image_free(&resized);
+  if (ret == 0) {
+    ret = output_publish_frame(h, out, jpeg, jpeg_sz);
+  }
+
+  if (jpeg != jpeg_buf) {
+    free(jpeg);
+  }
+  if (out->arena) {
+    mem_arena_reset(out->arena);
+  }
+  return ret;
+}
+
+static int output_publish_streamed(struct Outputs *h, struct Output *out) {
+  // Split the arena between row buffers and the encoded image. Rows are small,
+  // but there's no way of knowing how small before parsing the image.
+  unsigned char *scratch = NULL;
+  size_t scratch_sz = 0;
+  unsigned char *jpeg_buf = NULL;
+  size_t jpeg_buf_sz = 0;
+  if (out->arena) {
+    scratch_sz = mem_arena_available(out->arena) / 2;
+    scratch = mem_arena_alloc(out->arena, scratch_sz);
+    jpeg_buf_sz = mem_arena_available(out->arena);
+    jpeg_buf = mem_arena_alloc(out->arena, jpeg_buf_sz);
+  }
+
+  unsigned char *jpeg = jpeg_buf;
+  size_t jpeg_sz = jpeg_buf_sz;
+  int ret = jpeg_stream_downscale(h->img, h->img_sz, out->cfg->width,
+                                  out->cfg->height, OUTPUT_JPEG_QUALITY,
+                                  h->lut_enabled ? &h->lut : NULL, scratch,
+                                  scratch_sz, h->max_decode_sz, &jpeg,
+                                  &jpeg_sz);
+  if (ret == 0) {
+    ret = output_publish_frame(h, out, jpeg, jpeg_sz);
+  }
+
+  if (jpeg != jpeg_buf) {
+    free(jpeg);
+  }
+  if (out->arena) {
+    mem_arena_reset(out->arena);
+  }
+  return ret;
+}
+
+static void output_publish(struct Outputs *h, struct Output *out) {
+  const size_t out_idx = out - h->outs;
+  int ret;
+  if (out->needs_stream) {
+    ret = output_publish_streamed(h, out);
+  } else if (out->needs_resize && h->decoded.px) {
+    ret = output_publish_resized(h, out);
+  } else {
+    ret = output_publish_frame(h, out, h->img, h->img_sz);
+  }
+
+  if (ret < 0) {
+    trace_log(stderr, "Failed to update shm %s with received image\n",
+              out->cfg->shm_image_file_name);
+  }
+
+  if (!out->cfg->image_render_proc_name) {
+    return;
+  }
+
+  if (!shm_should_notify(out->shm)) {
+    trace_event(TRACE_EV_RENDERER_NOTIFY_SKIPPED, out->render_pid, out_idx, 0);
+    return;
+  }
+
+  out->render_pid = signal_single_kill_old(
+      SIGUSR1, out->cfg->image_render_proc_name, out->render_pid);
+  if (out->render_pid > 0) {
+    shm_on_notified(out->shm);
+    trace_event(TRACE_EV_RENDERER_NOTIFIED, out->render_pid, out_idx, 0);
+    trace_log(stdout, "Notified %s (pid %d) of new shm image\n",
+              out->cfg->image_render_proc_name, out->render_pid);
+  } else {
+    trace_log(stdout,
+              "Failed to notify %s of new shm image, can't find process\n",
+              out->cfg->image_render_proc_name);
+  }
+}
+
+// Publish outputs until there are none left for the current image
+static void outputs_publish_pending(struct Outputs *h) {
+  size_t i;
+  while ((i = atomic_fetch_add(&h->next_output, 1)) < h->count) {
+    output_publish(h, &h->outs[i]);
+  }
+}
+
+static void *outputs_worker(void *usr) {
+  struct Outputs *h = usr;
+  uint64_t generation = 0;
+  pthread_mutex_lock(&h->pool_lock);
+  while (true) {
+    while (!h->workers_stop && (h->work_generation == generation)) {
+      pthread_cond_wait(&h->work_ready, &h->pool_lock);
+    }
+    if (h->workers_stop) {
+      break;
+    }
+    generation = h->work_generation;
+    pthread_mutex_unlock(&h->pool_lock);
+
+    outputs_publish_pending(h);
+
+    pthread_mutex_lock(&h->pool_lock);
+    if (--h->workers_busy == 0) {
+      pthread_cond_signal(&h->work_done);
+    }
+  }
+  pthread_mutex_unlock(&h->pool_lock);
+  return NULL;
+}
+
+static void outputs_start_workers(struct Outputs *h) {
+  const long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  const size_t max_workers = ncpus > 1 ? ncpus - 1 : 0;
+  const size_t want = h->count - 1 < max_workers ? h->count - 1 : max_workers;
+  if (want == 0) {
+    return;
+  }
+
+  h->workers = malloc(sizeof(pthread_t) * want);
+  if (!h->workers) {
+    perror("outputs: can't create workers, will publish from one thread");
+    return;
+  }
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WORKER_STACK_SZ);
+  while (h->n_workers < want) {
+    if (pthread_create(&h->workers[h->n_workers], &attr, outputs_worker, h) !=
+        0) {
+      perror("outputs: can't create worker, will publish with fewer threads");
+      break;
+    }
+    h->n_workers++;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+static void outputs_stop_workers(struct Outputs *h) {
+  pthread_mutex_lock(&h->pool_lock);
+  h->workers_stop = true;
+  pthread_cond_broadcast(&h->work_ready);
+  pthread_mutex_unlock(&h->pool_lock);
+  for (size_t i = 0; i < h->n_workers; ++i) {
+    pthread_join(h->workers[i], NULL);
+  }
+  free(h->workers);
+  h->workers = NULL;
+  h->n_workers = 0;
+}
+
+// Decode the received image once, at the smallest size that's still good
+// enough for every output that needs to be resized. If that would take too
+// much memory, each output will instead stream-downscale the image on its own:
+// slower (the image is decoded once per output) but bounded to a few rows.
+// Images that are already small enough for an output, but too big for its shm,
+// are also streamed to re-encode them.
+static void outputs_decode_if_needed(struct Outputs *h) {
+  size_t img_w, img_h;
+  if (jpeg_get_size(h->img, h->img_sz, &img_w, &img_h) != 0) {
+    // Not something we can resize, publish as is
+    return;
+  }
+
+  const struct RgbImage src_sz = {
+      .px = NULL, .width = img_w, .height = img_h, .px_owned = false};
+  size_t min_w = 0, min_h = 0;
+  for (size_t i = 0; i < h->count; ++i) {
+    struct Output *out = &h->outs[i];
+    out->needs_resize = (img_w > out->cfg->width) ||
+                        (img_h > out->cfg->height) || h->lut_enabled;
+    out->needs_stream = !out->needs_resize && (h->img_sz > h->shm_max_sz);
+    if (out->needs_resize) {
+      size_t w, ht;
+      rgb_image_fit_size(&src_sz, out->cfg->width, out->cfg->height, &w, &ht);
+      min_w = w > min_w ? w : min_w;
+      min_h = ht > min_h ? ht : min_h;
+    }
+  }
+
+  if (min_w == 0) {
+    return;
+  }
+
+  size_t dec_w, dec_h;
+  jpeg_get_decoded_size(img_w, img_h, min_w, min_h, &dec_w, &dec_h);
+  if (dec_w * dec_h * 3 > h->max_decode_sz) {
+    trace_log(stdout,
+              "outputs: %zux%zu image too big to decode in full, streaming\n",
+              img_w, img_h);
+    for (size_t i = 0; i < h->count; ++i) {
+      h->outs[i].needs_stream |= h->outs[i].needs_resize;
+    }
+    return;
+  }
+
+  unsigned char *buf = NULL;
+  size_t buf_sz = 0;
+  if (h->decode_arena) {
+    buf_sz = mem_arena_available(h->decode_arena);
+    buf = mem_arena_alloc(h->decode_arena, buf_sz);
+  }
+
+  if (jpeg_decode(h->img, h->img_sz, min_w, min_h, buf, buf_sz,
+                  &h->decoded) != 0) {
+    fprintf(stderr, "outputs: can't decode received image, publishing as is\n");
+  }
+}
+
+// Pick the schedule entry for the current time of day, and rebuild the LUT if
+// it changed
+static void outputs_update_lut(struct Outputs *h) {
+  if (h->schedule_count == 0) {
+    return;
+  }
+
+  const time_t now = time(NULL);
+  struct tm local;
+  localtime_r(&now, &local);
+  const size_t minute_of_day = local.tm_hour * 60 + local.tm_min;
+
+  // Before the first entry of the day, the last one from yesterday is active
+  size_t active = h->schedule_count - 1;
+  for (size_t i = 0; i < h->schedule_count; ++i) {
+    if (h->schedule[i].start_minute_of_day <= minute_of_day) {
+      active = i;
+    }
+  }
+
+  if (active == h->schedule_active) {
+    return;
+  }
+
+  const struct AmbienceScheduleEntry *e = &h->schedule[active];
+  h->schedule_active = active;
+  color_lut_build(&h->lut, e->brightness_pct, e->warmth_pct, e->gamma_pct);
+  h->lut_enabled = !color_lut_is_identity(&h->lut);
+  printf("outputs: ambience schedule entry %zu active (brightness %zu%%, "
+         "warmth %zu%%, gamma %zu%%)%s\n",
+         active, e->brightness_pct, e->warmth_pct, e->gamma_pct,
+         h->lut_enabled ? "" : ", images published as is");
+}
+
+void outputs_print_stats(struct Outputs *h) {
+  for (size_t i = 0; i < h->count; ++i) {
+    struct ShmStats stats;
+    shm_get_stats(h->outs[i].shm, &stats);
+    printf("\toutput[%zu] %s: published=%zu, dropped=%zu, "
+           "notifications_skipped=%zu\n",
+           i, h->outs[i].cfg->shm_image_file_name, stats.frames_published,
+           stats.frames_dropped, stats.notifications_skipped);
+    if (h->outs[i].memfd) {
+      struct MemfdPubStats memfd_stats;
+      memfd_pub_get_stats(h->outs[i].memfd, &memfd_stats);
+      printf("\toutput[%zu] %s: memfd published=%zu, consumers=%zu, "
+             "dropped=%zu\n",
+             i, h->outs[i].cfg->memfd_socket_path,
+             memfd_stats.frames_published, memfd_stats.consumers_connected,
+             memfd_stats.frames_dropped);
+    }
+  }
+}
+
+void outputs_publish(struct Outputs *h, const void *img, size_t img_sz) {
+  h->img = img;
+  h->img_sz = img_sz;
+  h->decoded.px = NULL;
+  h->decoded.px_owned = false;
+  for (size_t i = 0; i < h->count; ++i) {
+    h->outs[i].needs_resize = false;
+    h->outs[i].needs_stream = false;
+  }
+  outputs_update_lut(h);
+  outputs_decode_if_needed(h);
+
+  // The calling thread is one of the workers
+  atomic_store(&h->next_output, 0);
+  pthread_mutex_lock(&h->pool_lock);
+  h->workers_busy = h->n_workers;
+  h->work_generation++;
+  pthread_cond_broadcast(&h->work_ready);
+  pthread_mutex_unlock(&h->pool_lock);
+
+  outputs_publish_pending(h);
+
+  pthread_mutex_lock(&h->pool_lock);
+  while (h->workers_busy > 0) {
+    pthread_cond_wait(&h->work_done, &h->pool_lock);
+  }
+  pthread_mutex_unlock(&h->pool_lock);
+
+  rgb_image_free(&h->decoded);
+  if (h->decode_arena) {
+    mem_arena_reset(h->decode_arena);
+  }
+  h->img = NULL;
+  h->img_sz = 0;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+
+struct AmbienceSvcConfig;
+
+// Publishes each received image to all configured outputs. Each output has its
+// own shm area and render process, and gets its own copy of the image, resized
+// to fit its geometry if needed. The image is decoded only once, and the
+// resize/encode/publish work for each output runs in parallel when more than
+// one core is available.
+struct Outputs;
+
+// In fixed memory mode, all buffers needed to decode/resize/encode images are
+// reserved (and locked in RAM) on init.
+struct Outputs *outputs_init(const struct AmbienceSvcConfig *cfg);
+
+// Free all outputs. If leak_image_path is set, each shm area is filled with the
+// contents of this file and left behind for its render process.
+void outputs_free(struct Outputs *h, const char *leak_image_path);
+
+// Publish an image to all outputs, and notify their render processes
+void outputs_publish(struct Outputs *h, const void *img, size_t img_sz);
+
+// Print per-output stats (frames published, dropped...)
+void outputs_print_stats(struct Outputs *h);
@@ -0,0 +1,297 @@
+#define _GNU_SOURCE
+#include "perf_prof.h"
+
+#include "trace.h"
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+enum PerfCounter {
+  PERF_CNT_CYCLES,
+  PERF_CNT_INSTRUCTIONS,
+  PERF_CNT_CACHE_MISSES,
+  PERF_CNT_PAGE_FAULTS,
+  PERF_CNT_CPU_NS,
+  PERF_CNT_COUNT,
+};
+
+struct PerfCounterDef {
+  uint32_t type;
+  uint64_t config;
+  // Tried if the generic event isn't supported by the PMU (ARMv6 has no
+  // generic cache miss event, but it can count L1 data cache misses)
+  bool has_alt;
+  uint32_t alt_type;
+  uint64_t alt_config;
+};
+
+static const struct PerfCounterDef g_counters[PERF_CNT_COUNT] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, false, 0, 0},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, false, 0,
+     0},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, true,
+     PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, false, 0, 0},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, false, 0, 0},
+};
+
+// Value read from a counter. enabled/running are the times the counter was
+// enabled and actually counting, which differ if the PMU has fewer counters
+// than events and the kernel multiplexes them.
+struct PerfReading {
+  uint64_t value;
+  uint64_t enabled;
+  uint64_t running;
+};
+
+struct PerfStageStats {
+  atomic_size_t runs;
+  atomic_uint_fast64_t sum[PERF_CNT_COUNT];
+  atomic_uint_fast64_t max[PERF_CNT_COUNT];
+};
+
+struct PerfProf {
+  int fds[PERF_CNT_COUNT];
+  // Only used by the thread running the pipeline
+  struct PerfReading start[PERF_CNT_COUNT];
+  // Counters of each stage for the current slide
+  bool slide_ran[PIPELINE_STAGE_COUNT];
+  uint64_t slide[PIPELINE_STAGE_COUNT][PERF_CNT_COUNT];
+
+  // Written by the pipeline, read by print_stats
+  atomic_bool available[PERF_CNT_COUNT];
+  struct PerfStageStats stages[PIPELINE_STAGE_COUNT];
+};
+
+static int perf_open(uint32_t type, uint64_t config) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.read_format =
+      PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr.exclude_hv = 1;
+  // Also count threads created after this (eg the output publish workers).
+  // Reading the counter adds up all of them.
+  attr.inherit = 1;
+
+  // Measure the calling thread, on any CPU
+  int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  if ((fd < 0) && (errno == EACCES)) {
+    // perf_event_paranoid may still allow counting user space only
+    attr.exclude_kernel = 1;
+    fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  }
+  return fd;
+}
+
+static void perf_prof_open_counters(struct PerfProf *h) {
+  bool any_hw = false;
+  bool any_sw = false;
+  for (size_t i = 0; i < PERF_CNT_COUNT; ++i) {
+    const struct PerfCounterDef *c = &g_counters[i];
+    h->fds[i] = perf_open(c->type, c->config);
+    if ((h->fds[i] < 0) && c->has_alt) {
+      h->fds[i] = perf_open(c->alt_type, c->alt_config);
+    }
+    any_hw |= (h->fds[i] >= 0) && (c->type != PERF_TYPE_SOFTWARE);
+    any_sw |= (h->fds[i] >= 0) && (c->type == PERF_TYPE_SOFTWARE);
+    // Software counters can be emulated without perf
+    h->available[i] = (h->fds[i] >= 0) || (c->type == PERF_TYPE_SOFTWARE);
+  }
+
+  trace_log(stdout, "perf_prof: profiling with %s counters\n",
+            any_hw   ? "hardware"
+            : any_sw ? "software perf"
+                     : "getrusage");
+}
+
+static void perf_prof_read(struct PerfProf *h, struct PerfReading *out) {
+  struct rusage ru;
+  struct timespec ts;
+  bool have_ru = false;
+  bool have_ts = false;
+  for (size_t i = 0; i < PERF_CNT_COUNT; ++i) {
+    memset(&out[i], 0, sizeof(out[i]));
+    if (h->fds[i] >= 0) {
+      if (read(h->fds[i], &out[i], sizeof(out[i])) != sizeof(out[i])) {
+        memset(&out[i], 0, sizeof(out[i]));
+      }
+    } else if (i == PERF_CNT_PAGE_FAULTS) {
+      have_ru = have_ru || (getrusage(RUSAGE_SELF, &ru) == 0);
+      out[i].value = have_ru ? ru.ru_minflt + ru.ru_majflt : 0;
+    } else if (i == PERF_CNT_CPU_NS) {
+      have_ts =
+          have_ts || (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) == 0);
+      out[i].value =
+          have_ts ? (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec : 0;
+    }
+  }
+}
+
+// Counter delta between two readings, scaled up if the counter was
+// multiplexed
+static uint64_t perf_delta(const struct PerfReading *a,
+                           const struct PerfReading *b) {
+  if (b->value < a->value) {
+    return 0;
+  }
+  const uint64_t value = b->value - a->value;
+  const uint64_t enabled = b->enabled - a->enabled;
+  const uint64_t running = b->running - a->running;
+  if ((running == 0) || (running >= enabled)) {
+    return value;
+  }
+  return (uint64_t)((double)value * enabled / running);
+}
+
+struct PerfProf *perf_prof_init(void) {
+  struct PerfProf *h = malloc(sizeof(struct PerfProf));
+  if (!h) {
+    perror("perf_prof: bad alloc");
+    return NULL;
+  }
+
+  memset(h, 0, sizeof(struct PerfProf));
+  perf_prof_open_counters(h);
+  return h;
+}
+
+void perf_prof_free(struct PerfProf *h) {
+  if (!h) {
+    return;
+  }
+  for (size_t i = 0; i < PERF_CNT_COUNT; ++i) {
+    if (h->fds[i] >= 0) {
+      close(h->fds[i]);
+    }
+  }
+  free(h);
+}
+
+void perf_prof_stage_start(struct PerfProf *h, enum PipelineStage stage) {
+  if (!h) {
+    return;
+  }
+  perf_prof_read(h, h->start);
+}
+
+void perf_prof_stage_end(struct PerfProf *h, enum PipelineStage stage) {
+  if (!h || (stage >= PIPELINE_STAGE_COUNT)) {
+    return;
+  }
+
+  struct PerfReading end[PERF_CNT_COUNT];
+  perf_prof_read(h, end);
+
+  struct PerfStageStats *s = &h->stages[stage];
+  for (size_t i = 0; i < PERF_CNT_COUNT; ++i) {
+    const uint64_t v = perf_delta(&h->start[i], &end[i]);
+    h->slide[stage][i] = v;
+    s->sum[i] += v;
+    if (v > s->max[i]) {
+      s->max[i] = v;
+    }
+  }
+  s->runs++;
+  h->slide_ran[stage] = true;
+  trace_event(TRACE_EV_STAGE_PERF, stage, h->slide[stage][PERF_CNT_CYCLES],
+              h->slide[stage][PERF_CNT_INSTRUCTIONS]);
+}
+
+// Print a count with a metric suffix, eg 12.3M
+static void fmt_count(char *buf, size_t buf_sz, double v) {
+  if (v >= 1e9) {
+    snprintf(buf, buf_sz, "%.1fG", v / 1e9);
+  } else if (v >= 1e6) {
+    snprintf(buf, buf_sz, "%.1fM", v / 1e6);
+  } else if (v >= 1e3) {
+    snprintf(buf, buf_sz, "%.1fk", v / 1e3);
+  } else {
+    snprintf(buf, buf_sz, "%.0f", v);
+  }
+}
+
+// Print the counters of a stage, one value per counter. IPC only makes sense
+// if all values come from the same run (or are averages).
+static void fmt_counters(struct PerfProf *h, char *buf, size_t buf_sz,
+                         const double *v, bool with_ipc) {
+  char cyc[16], ins[16], miss[16];
+  fmt_count(cyc, sizeof(cyc), v[PERF_CNT_CYCLES]);
+  fmt_count(ins, sizeof(ins), v[PERF_CNT_INSTRUCTIONS]);
+  fmt_count(miss, sizeof(miss), v[PERF_CNT_CACHE_MISSES]);
+  char ipc[16] = "n/a";
+  if (h->available[PERF_CNT_CYCLES] && h->available[PERF_CNT_INSTRUCTIONS] &&
+      (v[PERF_CNT_CYCLES] > 0)) {
+    snprintf(ipc, sizeof(ipc), "%.2f",
+             v[PERF_CNT_INSTRUCTIONS] / v[PERF_CNT_CYCLES]);
+  }
+  const int n = snprintf(
+      buf, buf_sz, "%.2f ms, %s cycles, %s instr, %s cache misses, %.0f page "
+                   "faults",
+      v[PERF_CNT_CPU_NS] / 1e6, h->available[PERF_CNT_CYCLES] ? cyc : "n/a",
+      h->available[PERF_CNT_INSTRUCTIONS] ? ins : "n/a",
+      h->available[PERF_CNT_CACHE_MISSES] ? miss : "n/a",
+      v[PERF_CNT_PAGE_FAULTS]);
+  if (with_ipc && (n > 0) && ((size_t)n < buf_sz)) {
+    snprintf(buf + n, buf_sz - n, ", IPC %s", ipc);
+  }
+}
+
+void perf_prof_on_slide(struct PerfProf *h) {
+  if (!h) {
+    return;
+  }
+
+  for (size_t st = 0; st < PIPELINE_STAGE_COUNT; ++st) {
+    if (!h->slide_ran[st]) {
+      continue;
+    }
+    double v[PERF_CNT_COUNT];
+    for (size_t i = 0; i < PERF_CNT_COUNT; ++i) {
+      v[i] = h->slide[st][i];
+    }
+    char buf[256];
+    fmt_counters(h, buf, sizeof(buf), v, true);
+    trace_log(stdout, "Slide perf [%s]: %s\n", pipeline_stage_name(st), buf);
+    h->slide_ran[st] = false;
+  }
+}
+
+void perf_prof_print_stats(struct PerfProf *h) {
+  if (!h) {
+    return;
+  }
+
+  for (size_t st = 0; st < PIPELINE_STAGE_COUNT; ++st) {
+    const struct PerfStageStats *s = &h->stages[st];
+    const size_t runs = s->runs;
+    if (runs == 0) {
+      continue;
+    }
+    double avg[PERF_CNT_COUNT];
+    double max[PERF_CNT_COUNT];
+    for (size_t i = 0; i < PERF_CNT_COUNT; ++i) {
+      avg[i] = (double)s->sum[i] / runs;
+      max[i] = s->max[i];
+    }
+    char avg_buf[256], max_buf[256];
+    fmt_counters(h, avg_buf, sizeof(avg_buf), avg, true);
+    fmt_counters(h, max_buf, sizeof(max_buf), max, false);
+    printf("\tperf[%s] avg: %s\n", pipeline_stage_name(st), avg_buf);
+    printf("\tperf[%s] max: %s\n", pipeline_stage_name(st), max_buf);
+  }
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include "pipeline_stage.h"
+
+// Profiles each pipeline stage with perf_event_open counters: CPU cycles,
+// instructions, cache misses, page faults and CPU time. Counters are opened by
+// perf_prof_init and inherited by every thread created after it, so call it
+// before starting any thread that does pipeline work (eg the output publish
+// workers). Stages measure the whole process, so anything else running
+// meanwhile is charged to the stage too.
+//
+// If the hardware PMU isn't available (eg in a container, in a VM, or when
+// perf_event_paranoid doesn't allow it), cycles, instructions and cache misses
+// are reported as n/a. Page faults and CPU time then come from software perf
+// counters, or from getrusage and the process CPU clock if perf_event_open
+// isn't allowed at all.
+//
+// All functions are no-ops if h is NULL.
+struct PerfProf;
+
+struct PerfProf *perf_prof_init(void);
+void perf_prof_free(struct PerfProf *h);
+
+// Stages can't be nested
+void perf_prof_stage_start(struct PerfProf *h, enum PipelineStage stage);
+void perf_prof_stage_end(struct PerfProf *h, enum PipelineStage stage);
+
+// Call once all stages of a slide ran, to log the counters of this slide
+void perf_prof_on_slide(struct PerfProf *h);
+
+// Aggregate counters, per stage
+void perf_prof_print_stats(struct PerfProf *h);
@@ -0,0 +1,24 @@
+#pragma once
+
+// Stages of on_image_received, for the instrumentation modes that report costs
+// per stage. Whatever happens between slides (network fetch, the slideshow
+// sleep loop) isn't a stage, and is reported as "idle".
+enum PipelineStage {
+  PIPELINE_STAGE_RECORD,  // slide_record_write
+  PIPELINE_STAGE_META,    // Metadata parse and eInk render
+  PIPELINE_STAGE_PUBLISH, // Decode, resize, shm/memfd and renderer notify
+  PIPELINE_STAGE_COUNT,
+};
+
+static inline const char *pipeline_stage_name(enum PipelineStage stage) {
+  switch (stage) {
+  case PIPELINE_STAGE_RECORD:
+    return "record";
+  case PIPELINE_STAGE_META:
+    return "meta";
+  case PIPELINE_STAGE_PUBLISH:
+    return "publish";
+  default:
+    return "unknown";
+  }
+}
@@ -0,0 +1,205 @@
+#include "power_acct.h"
+
+#include "time_utils.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+// Process wide counters at some point in time
+struct PowerSample {
+  uint64_t wall_ms;
+  uint64_t cpu_us;
+  // Voluntary context switches
+  uint64_t wakeups;
+  // Involuntary context switches
+  uint64_t preemptions;
+  // Read and write syscalls (from /proc/self/io, 0 if not available)
+  uint64_t io_syscalls;
+};
+
+struct PowerAcct {
+  size_t budget_cpu_ms_per_slide;
+  size_t budget_wakeups_per_hour;
+
+  // Only used by the thread running the pipeline
+  uint64_t stage_start_us;
+
+  // Written by the pipeline, read by print_stats
+  atomic_uint_fast64_t stage_cpu_us[PIPELINE_STAGE_COUNT];
+  atomic_size_t stage_runs[PIPELINE_STAGE_COUNT];
+
+  // Only used by the thread running the slideshow loop
+  struct PowerSample first;
+  struct PowerSample last;
+  size_t cycles;
+  size_t cycles_over_budget;
+  uint64_t max_cycle_cpu_us;
+};
+
+static uint64_t timeval_to_us(const struct timeval *tv) {
+  return (uint64_t)tv->tv_sec * 1000000ull + (uint64_t)tv->tv_usec;
+}
+
+static uint64_t process_cpu_us(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) {
+    return 0;
+  }
+  return timeval_to_us(&ru.ru_utime) + timeval_to_us(&ru.ru_stime);
+}
+
+// Number of read and write syscalls made by the process. Read without stdio,
+// so sampling doesn't allocate.
+static uint64_t read_io_syscalls(void) {
+  int fd = open("/proc/self/io", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+
+  char buf[512];
+  const ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0) {
+    return 0;
+  }
+  buf[n] = '\0';
+
+  uint64_t count = 0;
+  const char *keys[] = {"syscr:", "syscw:"};
+  for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+    const char *v = strstr(buf, keys[i]);
+    if (v) {
+      count += strtoull(v + strlen(keys[i]), NULL, 10);
+    }
+  }
+  return count;
+}
+
+static void power_sample(struct PowerSample *s) {
+  s->wall_ms = time_now_ms();
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0) {
+    memset(&ru, 0, sizeof(ru));
+  }
+  s->cpu_us = timeval_to_us(&ru.ru_utime) + timeval_to_us(&ru.ru_stime);
+  s->wakeups = ru.ru_nvcsw;
+  s->preemptions = ru.ru_nivcsw;
+  s->io_syscalls = read_io_syscalls();
+}
+
+struct PowerAcct *power_acct_init(size_t budget_cpu_ms_per_slide,
+                                  size_t budget_wakeups_per_hour) {
+  struct PowerAcct *h = malloc(sizeof(struct PowerAcct));
+  if (!h) {
+    perror("power_acct: bad alloc");
+    return NULL;
+  }
+
+  h->budget_cpu_ms_per_slide = budget_cpu_ms_per_slide;
+  h->budget_wakeups_per_hour = budget_wakeups_per_hour;
+  h->stage_start_us = 0;
+  for (size_t i = 0; i < PIPELINE_STAGE_COUNT; ++i) {
+    atomic_init(&h->stage_cpu_us[i], 0);
+    atomic_init(&h->stage_runs[i], 0);
+  }
+  power_sample(&h->first);
+  h->last = h->first;
+  h->cycles = 0;
+  h->cycles_over_budget = 0;
+  h->max_cycle_cpu_us = 0;
+  return h;
+}
+
+void power_acct_free(struct PowerAcct *h) { free(h); }
+
+void power_acct_stage_start(struct PowerAcct *h, enum PipelineStage stage) {
+  if (!h) {
+    return;
+  }
+  h->stage_start_us = process_cpu_us();
+}
+
+void power_acct_stage_end(struct PowerAcct *h, enum PipelineStage stage) {
+  if (!h || (stage >= PIPELINE_STAGE_COUNT)) {
+    return;
+  }
+  const uint64_t now_us = process_cpu_us();
+  if (now_us > h->stage_start_us) {
+    h->stage_cpu_us[stage] += now_us - h->stage_start_us;
+  }
+  h->stage_runs[stage]++;
+}
+
+void power_acct_on_cycle(struct PowerAcct *h) {
+  if (!h) {
+    return;
+  }
+
+  struct PowerSample now;
+  power_sample(&now);
+  const uint64_t cpu_us = now.cpu_us - h->last.cpu_us;
+  const uint64_t wakeups = now.wakeups - h->last.wakeups;
+  const uint64_t wall_ms = now.wall_ms - h->last.wall_ms;
+  const uint64_t wakeups_per_hour =
+      wall_ms ? wakeups * 3600 * 1000 / wall_ms : 0;
+  trace_event(TRACE_EV_POWER_CYCLE, cpu_us, wakeups,
+              now.io_syscalls - h->last.io_syscalls);
+  h->last = now;
+  h->cycles++;
+  if (cpu_us > h->max_cycle_cpu_us) {
+    h->max_cycle_cpu_us = cpu_us;
+  }
+
+  const bool cpu_over = h->budget_cpu_ms_per_slide &&
+                        (cpu_us / 1000 > h->budget_cpu_ms_per_slide);
+  const bool wakeups_over = h->budget_wakeups_per_hour &&
+                            (wakeups_per_hour > h->budget_wakeups_per_hour);
+  if (cpu_over || wakeups_over) {
+    h->cycles_over_budget++;
+    trace_event(TRACE_EV_POWER_OVER_BUDGET, cpu_us / 1000, wakeups_per_hour,
+                0);
+    trace_log(stderr,
+              "Power budget exceeded: slide used %.1f CPU-ms (budget %zu), "
+              "%zu wakeups/h (budget %zu)\n",
+              cpu_us / 1e3, h->budget_cpu_ms_per_slide,
+              (size_t)wakeups_per_hour, h->budget_wakeups_per_hour);
+  }
+}
+
+void power_acct_print_stats(struct PowerAcct *h) {
+  if (!h) {
+    return;
+  }
+
+  const struct PowerSample *a = &h->first;
+  const struct PowerSample *b = &h->last;
+  const size_t slides = h->stage_runs[PIPELINE_STAGE_PUBLISH];
+  const double per_slide = slides ? 1.0 / slides : 0;
+  const double hours = (b->wall_ms - a->wall_ms) / 3600e3;
+
+  uint64_t stages_us = 0;
+  printf("\tpower: CPU-ms/slide:");
+  for (size_t i = 0; i < PIPELINE_STAGE_COUNT; ++i) {
+    const uint64_t us = h->stage_cpu_us[i];
+    stages_us += us;
+    printf(" %s=%.1f", pipeline_stage_name(i), us / 1e3 * per_slide);
+  }
+  const uint64_t total_us = b->cpu_us - a->cpu_us;
+  printf(" idle=%.1f total=%.1f (max cycle %.1f)\n",
+         (total_us > stages_us ? total_us - stages_us : 0) / 1e3 * per_slide,
+         total_us / 1e3 * per_slide, h->max_cycle_cpu_us / 1e3);
+  printf("\tpower: wakeups/h=%.0f, preemptions/h=%.0f, io_syscalls/slide=%.1f, "
+         "cycles over budget=%zu/%zu\n",
+         hours > 0 ? (b->wakeups - a->wakeups) / hours : 0,
+         hours > 0 ? (b->preemptions - a->preemptions) / hours : 0,
+         (b->io_syscalls - a->io_syscalls) * per_slide, h->cycles_over_budget,
+         h->cycles);
+}
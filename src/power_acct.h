@@ -0,0 +1,32 @@
+#pragma once
+
+#include "pipeline_stage.h"
+
+#include <stddef.h>
+
+// Accounts for the CPU time and wakeups the service costs, to keep an eye on
+// its idle efficiency. Wakeups are voluntary context switches (ie the process
+// blocked on a sleep, a poll or I/O, and was woken up again), summed over all
+// threads. Each slideshow cycle is checked against a budget, and cycles over
+// it are logged.
+//
+// All functions are no-ops if h is NULL.
+struct PowerAcct;
+
+// A budget of 0 disables that check
+struct PowerAcct *power_acct_init(size_t budget_cpu_ms_per_slide,
+                                  size_t budget_wakeups_per_hour);
+void power_acct_free(struct PowerAcct *h);
+
+// Measure the CPU time the process spends in a stage, including the work the
+// stage hands off to other threads (eg the output publish workers). Anything
+// else running meanwhile (eg libwwwslide) is charged to the stage too, so
+// stages can't be nested.
+void power_acct_stage_start(struct PowerAcct *h, enum PipelineStage stage);
+void power_acct_stage_end(struct PowerAcct *h, enum PipelineStage stage);
+
+// Call once per slideshow cycle (a slide request and the wait until the next
+// one), from the thread running the slideshow loop.
+void power_acct_on_cycle(struct PowerAcct *h);
+
+void power_acct_print_stats(struct PowerAcct *h);
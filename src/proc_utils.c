@@ -1,9 +1,10 @@
 #include "proc_utils.h"
 
-// Macro to get memmem
-#define _GNU_SOURCE
 #include <string.h>
 
+#include "alloc_counter.h"
+#include "trace.h"
+
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
@@ -18,7 +19,6 @@ int kill_old_and_get_pid_for(const char *process_name) {
     return -1;
   }
 
-  const size_t process_name_len = strlen(process_name);
   int pid = -1;
   struct dirent *entry;
   while ((entry = readdir(dir)) != NULL) {
@@ -36,10 +36,15 @@ int kill_old_and_get_pid_for(const char *process_name) {
       continue;
     }
 
-    const size_t read_sz = fread(tmpbuff, 1, sizeof(tmpbuff), cmd_file);
+    const size_t read_sz = fread(tmpbuff, 1, sizeof(tmpbuff) - 1, cmd_file);
     if (read_sz > 0) {
-      // cmd args may have \0's, so strstr won't work
-      if (memmem(tmpbuff, read_sz, process_name, process_name_len) != NULL) {
+      // Args are \0 separated, so this is argv[0]. Match its basename exactly:
+      // a substring match would confuse eg "renderer" with "renderer_small",
+      // or with any process that has the name somewhere in its args.
+      tmpbuff[read_sz] = '\0';
+      const char *exe = strrchr(tmpbuff, '/');
+      exe = exe ? exe + 1 : tmpbuff;
+      if (strcmp(exe, process_name) == 0) {
         if (pid != -1) {
           fprintf(
               stderr,
@@ -63,11 +68,15 @@ int kill_old_and_get_pid_for(const char *process_name) {
 int signal_single_kill_old_impl(int signum, const char *proc_name,
                                 int last_known_pid, int retry) {
   if (last_known_pid == -1) {
+    // Scanning /proc allocates dirent and stdio buffers inside libc
+    alloc_counter_lib_enter();
     last_known_pid = kill_old_and_get_pid_for(proc_name);
+    alloc_counter_lib_exit();
   }
 
   if (last_known_pid <= 0) {
-    printf("Can't find pid for %s, no signal sent\n", proc_name);
+    trace_event_str(TRACE_EV_RENDERER_NOT_FOUND, proc_name);
+    trace_log(stdout, "Can't find pid for %s, no signal sent\n", proc_name);
     return -1;
   }
 
@@ -78,9 +87,11 @@ int signal_single_kill_old_impl(int signum, const char *proc_name,
 
   if (sigret == ESRCH) {
     if (retry > 0) {
-      printf("Known pid %d for proc %s is no longer valid (crashed?), will "
-             "search new pid\n",
-             last_known_pid, proc_name);
+      trace_event(TRACE_EV_RENDERER_PID_STALE, last_known_pid, 0, 0);
+      trace_log(stdout,
+                "Known pid %d for proc %s is no longer valid (crashed?), will "
+                "search new pid\n",
+                last_known_pid, proc_name);
       return signal_single_kill_old_impl(signum, proc_name, -1, retry - 1);
     } else {
       fprintf(stderr,
@@ -1,6 +1,7 @@
 #pragma once
 
-// Get a PID for process_name. If multiple are found, sigkill a random one.
+// Get a PID for process_name, matched against the basename of each process'
+// argv[0]. If multiple are found, sigkill all but one.
 int kill_old_and_get_pid_for(const char *process_name);
 
 // Attempt to deliver a signal to last_known_pid. If it fails, look for a
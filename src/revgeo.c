@@ -0,0 +1,233 @@
+#include "revgeo.h"
+#include "json.h"
+#include "time_utils.h"
+#include "trace.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EARTH_RADIUS_KM 6371.0
+// Max size of a GPS value in the metadata, eg "[52, 22, 2321/100]"
+#define GPS_VALUE_MAX_SZ 64
+
+struct RevGeo {
+  const void *map;
+  size_t map_sz;
+  const struct RevGeoNode *nodes;
+  size_t n_places;
+  const char *names;
+  size_t names_sz;
+  // Squared distance between unit vectors at max_distance_km
+  float max_dist2;
+};
+
+void revgeo_free(struct RevGeo *h) {
+  if (!h) {
+    return;
+  }
+
+  if (h->map) {
+    munmap((void *)h->map, h->map_sz);
+  }
+  free(h);
+}
+
+struct RevGeo *revgeo_init(const char *index_path, size_t max_distance_km) {
+  struct RevGeo *h = malloc(sizeof(struct RevGeo));
+  if (!h) {
+    perror("revgeo: bad alloc");
+    return NULL;
+  }
+  memset(h, 0, sizeof(struct RevGeo));
+
+  int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("revgeo: can't open index");
+    goto err;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    perror("revgeo: can't stat index");
+    close(fd);
+    goto err;
+  }
+
+  if ((size_t)st.st_size < sizeof(struct RevGeoHeader)) {
+    fprintf(stderr, "revgeo: %s is not an index, too small\n", index_path);
+    close(fd);
+    goto err;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("revgeo: can't mmap index");
+    goto err;
+  }
+  h->map = map;
+  h->map_sz = st.st_size;
+
+  const struct RevGeoHeader *hdr = map;
+  if ((hdr->magic != REVGEO_MAGIC) || (hdr->version != REVGEO_VERSION)) {
+    fprintf(stderr, "revgeo: %s is not an index, or has the wrong version\n",
+            index_path);
+    goto err;
+  }
+
+  // In 64 bits, so a corrupt header can't wrap the sizes around on a 32 bit
+  // target. Check n_places before multiplying, so even that can't overflow.
+  const uint64_t body_sz = h->map_sz - sizeof(struct RevGeoHeader);
+  const uint64_t n_places = hdr->n_places;
+  if ((n_places > body_sz / sizeof(struct RevGeoNode)) ||
+      (n_places * sizeof(struct RevGeoNode) + hdr->names_sz != body_sz)) {
+    fprintf(stderr, "revgeo: %s is truncated or corrupt\n", index_path);
+    goto err;
+  }
+
+  h->nodes = (const struct RevGeoNode *)(hdr + 1);
+  h->n_places = hdr->n_places;
+  h->names = (const char *)(h->nodes + h->n_places);
+  h->names_sz = hdr->names_sz;
+  // Lookups return names without checking them, so they must all be valid
+  if ((h->names_sz == 0) || (h->names[h->names_sz - 1] != '\0')) {
+    fprintf(stderr, "revgeo: %s has an invalid names section\n", index_path);
+    goto err;
+  }
+  for (size_t i = 0; i < h->n_places; ++i) {
+    if (h->nodes[i].name_off >= h->names_sz) {
+      fprintf(stderr, "revgeo: %s has an invalid name for place %zu\n",
+              index_path, i);
+      goto err;
+    }
+  }
+
+  const double chord = 2 * sin(max_distance_km / EARTH_RADIUS_KM / 2);
+  h->max_dist2 = chord * chord;
+  printf("revgeo: loaded %zu places from %s\n", h->n_places, index_path);
+  return h;
+
+err:
+  revgeo_free(h);
+  return NULL;
+}
+
+static void revgeo_search(const struct RevGeoNode *nodes, size_t lo, size_t hi,
+                          unsigned axis, const float q[3], size_t *best,
+                          float *best_dist2) {
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const struct RevGeoNode *n = &nodes[mid];
+    const float dx = q[0] - n->pos[0];
+    const float dy = q[1] - n->pos[1];
+    const float dz = q[2] - n->pos[2];
+    const float dist2 = dx * dx + dy * dy + dz * dz;
+    if (dist2 < *best_dist2) {
+      *best_dist2 = dist2;
+      *best = mid;
+    }
+
+    // Descend into the side of the split q is in, and only visit the other
+    // side if it may have something closer than the best match so far
+    const float diff = q[axis] - n->pos[axis];
+    const unsigned next_axis = (axis + 1) % 3;
+    if (diff < 0) {
+      if (diff * diff < *best_dist2) {
+        revgeo_search(nodes, mid + 1, hi, next_axis, q, best, best_dist2);
+      }
+      hi = mid;
+    } else {
+      if (diff * diff < *best_dist2) {
+        revgeo_search(nodes, lo, mid, next_axis, q, best, best_dist2);
+      }
+      lo = mid + 1;
+    }
+    axis = next_axis;
+  }
+}
+
+const char *revgeo_lookup(struct RevGeo *h, double lat, double lon) {
+  if ((lat < -90) || (lat > 90) || (lon < -180) || (lon > 180)) {
+    return NULL;
+  }
+
+  float q[3];
+  revgeo_latlon_to_pos(lat, lon, q);
+  size_t best = h->n_places;
+  float best_dist2 = h->max_dist2;
+  revgeo_search(h->nodes, 0, h->n_places, 0, q, &best, &best_dist2);
+  return best < h->n_places ? h->names + h->nodes[best].name_off : NULL;
+}
+
+// Parse a GPS coordinate: either a plain number in degrees, or a list of up to
+// three degrees/minutes/seconds values, each one a number or a rational
+// (eg "[52, 22, 2321/100]")
+static bool revgeo_parse_coord(const char *s, double *out) {
+  static const double scale[] = {1.0, 60.0, 3600.0};
+  double deg = 0;
+  size_t n = 0;
+  while (*s && (n < 3)) {
+    if (!strchr("0123456789.-", *s)) {
+      s++;
+      continue;
+    }
+
+    char *end;
+    double v = strtod(s, &end);
+    if (end == s) {
+      s++;
+      continue;
+    }
+    if (*end == '/') {
+      const double den = strtod(end + 1, &end);
+      if (den <= 0) {
+        return false;
+      }
+      v /= den;
+    }
+    deg += v / scale[n++];
+    s = end;
+  }
+
+  *out = deg;
+  return n > 0;
+}
+
+static bool revgeo_get_meta_coord(const char *meta_json, const char *key,
+                                  const char *ref_key, char negative_ref,
+                                  double *out) {
+  char v[GPS_VALUE_MAX_SZ];
+  char ref[GPS_VALUE_MAX_SZ];
+  if (!json_str_get_nested_key(meta_json, key, v, sizeof(v)) ||
+      !revgeo_parse_coord(v, out)) {
+    return false;
+  }
+
+  if (json_str_get_nested_key(meta_json, ref_key, ref, sizeof(ref)) &&
+      (ref[0] == negative_ref)) {
+    *out = -*out;
+  }
+  return true;
+}
+
+const char *revgeo_lookup_meta(struct RevGeo *h, const char *meta_json) {
+  double lat, lon;
+  if (!meta_json ||
+      !revgeo_get_meta_coord(meta_json, "GPS GPSLatitude", "GPS GPSLatitudeRef",
+                             'S', &lat) ||
+      !revgeo_get_meta_coord(meta_json, "GPS GPSLongitude",
+                             "GPS GPSLongitudeRef", 'W', &lon)) {
+    return NULL;
+  }
+
+  const uint64_t start_ns = time_now_ns();
+  const char *place = revgeo_lookup(h, lat, lon);
+  trace_event(TRACE_EV_REVGEO_LOOKUP, place != NULL,
+              (time_now_ns() - start_ns) / 1000, 0);
+  return place;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Offline reverse geocoder: finds the place closest to a coordinate in an index
+// file built by revgeo_build. The index is mmap'd read-only, so it's shared
+// through the page cache with any other process (or restart) using it, and a
+// lookup doesn't allocate.
+struct RevGeo;
+
+// Index file format: a RevGeoHeader, n_places RevGeoNodes and names_sz bytes of
+// NUL terminated place names. Nodes are laid out as an implicit k-d tree over
+// the places' positions as unit vectors (so there's no special case for the
+// antimeridian or the poles): the root of a range [lo, hi) is at lo + (hi -
+// lo) / 2, and ranges split on x, y, z for depth 0, 1, 2, then wrap around.
+#define REVGEO_MAGIC 0x4f454752 // "RGEO"
+#define REVGEO_VERSION 1
+
+struct RevGeoHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t n_places;
+  uint32_t names_sz;
+};
+
+struct RevGeoNode {
+  float pos[3];
+  // Offset of the name of this place in the names section
+  uint32_t name_off;
+};
+
+// Position of a coordinate (in degrees) as a unit vector
+static inline void revgeo_latlon_to_pos(double lat, double lon, float pos[3]) {
+  const double lat_rad = lat * M_PI / 180.0;
+  const double lon_rad = lon * M_PI / 180.0;
+  pos[0] = cos(lat_rad) * cos(lon_rad);
+  pos[1] = cos(lat_rad) * sin(lon_rad);
+  pos[2] = sin(lat_rad);
+}
+
+// Places further than max_distance_km from a coordinate are never returned
+struct RevGeo *revgeo_init(const char *index_path, size_t max_distance_km);
+void revgeo_free(struct RevGeo *h);
+
+// Name of the place closest to lat/lon (in degrees), or NULL if there's none
+// close enough. The name is valid until revgeo_free.
+const char *revgeo_lookup(struct RevGeo *h, double lat, double lon);
+
+// Find the GPS coordinates in an image's metadata JSON (in the format exifread
+// uses, eg "GPS GPSLatitude": "[52, 22, 2321/100]" plus "GPS GPSLatitudeRef")
+// and look them up. Returns NULL if there are no coordinates, or no place close
+// enough to them.
+const char *revgeo_lookup_meta(struct RevGeo *h, const char *meta_json);
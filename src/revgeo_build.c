@@ -0,0 +1,219 @@
+// revgeo_build: build a reverse geocoding index for revgeo.h from a list of
+// places.
+//
+// Usage: revgeo_build places.txt index.revgeo
+//   places.txt is either a GeoNames dump (eg cities15000.txt from
+//   https://download.geonames.org/export/dump/), or a tab separated file with
+//   one "lat<TAB>lon<TAB>name" place per line.
+
+#include "revgeo.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// GeoNames columns we use
+#define GEONAMES_COL_NAME 1
+#define GEONAMES_COL_LAT 4
+#define GEONAMES_COL_LON 5
+#define GEONAMES_COL_COUNTRY 8
+#define MAX_COLS 20
+
+struct Places {
+  struct RevGeoNode *nodes;
+  size_t count;
+  size_t cap;
+  char *names;
+  size_t names_sz;
+  size_t names_cap;
+};
+
+static bool places_add(struct Places *p, double lat, double lon,
+                       const char *name, const char *country) {
+  if (p->count == p->cap) {
+    p->cap = p->cap ? p->cap * 2 : 1024;
+    struct RevGeoNode *nodes = realloc(p->nodes, p->cap * sizeof(*nodes));
+    if (!nodes) {
+      return false;
+    }
+    p->nodes = nodes;
+  }
+
+  const size_t name_sz =
+      strlen(name) + (country ? strlen(country) + 2 : 0) + 1;
+  while (p->names_sz + name_sz > p->names_cap) {
+    p->names_cap = p->names_cap ? p->names_cap * 2 : 64 * 1024;
+    char *names = realloc(p->names, p->names_cap);
+    if (!names) {
+      return false;
+    }
+    p->names = names;
+  }
+
+  struct RevGeoNode *n = &p->nodes[p->count++];
+  revgeo_latlon_to_pos(lat, lon, n->pos);
+  n->name_off = p->names_sz;
+  snprintf(p->names + p->names_sz, name_sz, "%s%s%s", name,
+           country ? ", " : "", country ? country : "");
+  p->names_sz += name_sz;
+  return true;
+}
+
+// Split a line on tabs, in place. Returns the number of columns.
+static size_t split_tabs(char *line, char **cols, size_t max_cols) {
+  size_t n = 0;
+  line[strcspn(line, "\r\n")] = '\0';
+  while (n < max_cols) {
+    cols[n++] = line;
+    line = strchr(line, '\t');
+    if (!line) {
+      break;
+    }
+    *line++ = '\0';
+  }
+  return n;
+}
+
+static bool places_load(FILE *fp, struct Places *p) {
+  char *line = NULL;
+  size_t line_cap = 0;
+  size_t line_num = 0;
+  size_t skipped = 0;
+  bool ok = true;
+  while (ok && (getline(&line, &line_cap, fp) > 0)) {
+    line_num++;
+    char *cols[MAX_COLS];
+    const size_t n = split_tabs(line, cols, MAX_COLS);
+    char *lat_end, *lon_end;
+    double lat, lon;
+    if (n == 3) {
+      lat = strtod(cols[0], &lat_end);
+      lon = strtod(cols[1], &lon_end);
+      ok = (*lat_end == '\0') && (*lon_end == '\0') && (cols[2][0] != '\0') &&
+           places_add(p, lat, lon, cols[2], NULL);
+    } else if (n > GEONAMES_COL_COUNTRY) {
+      lat = strtod(cols[GEONAMES_COL_LAT], &lat_end);
+      lon = strtod(cols[GEONAMES_COL_LON], &lon_end);
+      ok = (*lat_end == '\0') && (*lon_end == '\0') &&
+           places_add(p, lat, lon, cols[GEONAMES_COL_NAME],
+                      cols[GEONAMES_COL_COUNTRY][0]
+                          ? cols[GEONAMES_COL_COUNTRY]
+                          : NULL);
+    } else {
+      skipped++;
+      continue;
+    }
+
+    if (!ok) {
+      fprintf(stderr, "Invalid place (or out of memory) at line %zu\n",
+              line_num);
+    }
+  }
+
+  free(line);
+  if (skipped) {
+    fprintf(stderr, "Skipped %zu lines with an unknown format\n", skipped);
+  }
+  return ok;
+}
+
+// qsort has no context argument
+static unsigned g_sort_axis;
+
+static int node_cmp(const void *a, const void *b) {
+  const float va = ((const struct RevGeoNode *)a)->pos[g_sort_axis];
+  const float vb = ((const struct RevGeoNode *)b)->pos[g_sort_axis];
+  return (va > vb) - (va < vb);
+}
+
+// Lay out nodes[lo, hi) as the implicit k-d tree described in revgeo.h. Sorting
+// each range is more work than a median selection, but this runs offline and
+// it's hard to get wrong.
+static void kdtree_build(struct RevGeoNode *nodes, size_t lo, size_t hi,
+                         unsigned axis) {
+  if (hi - lo <= 1) {
+    return;
+  }
+
+  g_sort_axis = axis;
+  qsort(nodes + lo, hi - lo, sizeof(*nodes), node_cmp);
+  const size_t mid = lo + (hi - lo) / 2;
+  kdtree_build(nodes, lo, mid, (axis + 1) % 3);
+  kdtree_build(nodes, mid + 1, hi, (axis + 1) % 3);
+}
+
+static bool index_write(const struct Places *p, const char *path) {
+  // Write to a temp file and rename, so a running service never maps a half
+  // written index
+  const size_t tmp_path_sz = strlen(path) + sizeof(".tmp");
+  char *tmp_path = malloc(tmp_path_sz);
+  if (!tmp_path) {
+    return false;
+  }
+  snprintf(tmp_path, tmp_path_sz, "%s.tmp", path);
+
+  FILE *fp = fopen(tmp_path, "wb");
+  if (!fp) {
+    perror("Can't create index");
+    free(tmp_path);
+    return false;
+  }
+
+  const struct RevGeoHeader hdr = {.magic = REVGEO_MAGIC,
+                                   .version = REVGEO_VERSION,
+                                   .n_places = p->count,
+                                   .names_sz = p->names_sz};
+  bool ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1) &&
+            (fwrite(p->nodes, sizeof(*p->nodes), p->count, fp) == p->count) &&
+            (fwrite(p->names, 1, p->names_sz, fp) == p->names_sz);
+  ok &= fclose(fp) == 0;
+  if (!ok) {
+    perror("Can't write index");
+    remove(tmp_path);
+  } else if (rename(tmp_path, path) != 0) {
+    perror("Can't move index in place");
+    ok = false;
+  }
+
+  free(tmp_path);
+  return ok;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 3) {
+    fprintf(stderr, "Usage: %s places.txt index.revgeo\n", argv[0]);
+    return 1;
+  }
+
+  FILE *fp = fopen(argv[1], "r");
+  if (!fp) {
+    perror("Can't open places file");
+    return 1;
+  }
+
+  struct Places places;
+  memset(&places, 0, sizeof(places));
+  const bool loaded = places_load(fp, &places);
+  fclose(fp);
+  if (!loaded || (places.count == 0)) {
+    fprintf(stderr, "No places loaded from %s\n", argv[1]);
+    free(places.nodes);
+    free(places.names);
+    return 1;
+  }
+
+  kdtree_build(places.nodes, 0, places.count, 0);
+  const bool ok = index_write(&places, argv[2]);
+  if (ok) {
+    printf("Wrote %zu places (%zu KB) to %s\n", places.count,
+           (sizeof(struct RevGeoHeader) +
+            places.count * sizeof(struct RevGeoNode) + places.names_sz) /
+               1024,
+           argv[2]);
+  }
+
+  free(places.nodes);
+  free(places.names);
+  return ok ? 0 : 1;
+}
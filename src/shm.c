@@ -1,7 +1,10 @@
 #include "shm.h"
+#include "shm_ctl.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,13 +16,38 @@
 // shm sz can't ever be 0 for mmap
 #define MIN_SHM_SZ 1
 
+// Frames are copied and checksummed in chunks small enough to stay in the L1
+// cache between the two. Must be a multiple of 4, see shm_ctl_checksum_update.
+#define SHM_COPY_CHUNK_SZ 4096
+
+// If a consumer looks stuck on an old frame for this many updates, notify it
+// anyway: it may have missed a signal
+#define MAX_CONSECUTIVE_SKIPPED_NOTIFICATIONS 3
+
 struct ShmHandle {
   const char *fname;
   int fd;
   void *ptr;
+  // Size of the mapping/file; may be bigger than frame_sz if consumers use the
+  // control block
   size_t sz;
+  size_t frame_sz;
   size_t max_sz;
   bool should_leak_shm;
+
+  const char *ctl_fname;
+  int ctl_fd;
+  struct ShmCtl *ctl;
+
+  // Set on each update: some consumer is still busy with an older frame
+  bool consumers_behind;
+  // Last frame consumers were told about (see shm_on_notified). A consumer
+  // that didn't ack it is busy; one that didn't ack a frame it was never told
+  // about is just waiting for a notification.
+  bool notified;
+  uint32_t notified_seq;
+  size_t consecutive_skipped_notifications;
+  struct ShmStats stats;
 };
 
 void shm_free(struct ShmHandle *h) {
@@ -31,12 +59,23 @@ void shm_free(struct ShmHandle *h) {
     munmap(h->ptr, h->sz);
   }
 
+  if (h->ctl) {
+    munmap(h->ctl, sizeof(struct ShmCtl));
+  }
+
   if (!h->should_leak_shm) {
     shm_unlink(h->fname);
+    if (h->ctl_fname) {
+      shm_unlink(h->ctl_fname);
+    }
   }
 
   free((void *)h->fname);
+  free((void *)h->ctl_fname);
   close(h->fd);
+  if (h->ctl_fd >= 0) {
+    close(h->ctl_fd);
+  }
   free(h);
 }
 
@@ -45,20 +84,228 @@ void shm_free_leak_shm(struct ShmHandle *h) {
   shm_free(h);
 }
 
-struct ShmHandle *shm_init(const char *shm_shared_fname, size_t max_sz_bytes) {
+static int shm_ctl_init(struct ShmHandle *h) {
+  const size_t fname_sz = strlen(h->fname) + sizeof(SHM_CTL_FNAME_SUFFIX);
+  char *ctl_fname = malloc(fname_sz);
+  if (!ctl_fname) {
+    perror("shm: ctl fname, bad alloc");
+    return -ENOMEM;
+  }
+  snprintf(ctl_fname, fname_sz, "%s%s", h->fname, SHM_CTL_FNAME_SUFFIX);
+  h->ctl_fname = ctl_fname;
+
+  h->ctl_fd = shm_open(h->ctl_fname, O_CREAT | O_RDWR, 0666);
+  if (h->ctl_fd < 0) {
+    perror("shm: can't open ctl");
+    return -errno;
+  }
+
+  if (ftruncate(h->ctl_fd, sizeof(struct ShmCtl)) < 0) {
+    perror("shm: can't resize ctl");
+    return -errno;
+  }
+
+  void *ptr = mmap(NULL, sizeof(struct ShmCtl), PROT_READ | PROT_WRITE,
+                   MAP_SHARED, h->ctl_fd, 0);
+  if (ptr == MAP_FAILED) {
+    perror("shm: can't mmap ctl");
+    return -errno;
+  }
+  h->ctl = ptr;
+
+  // Keep consumer registrations and the frame sequence if the control block
+  // survived a restart, so consumers don't need to know we restarted
+  if ((h->ctl->magic != SHM_CTL_MAGIC) ||
+      (h->ctl->version != SHM_CTL_VERSION)) {
+    memset(h->ctl, 0, sizeof(struct ShmCtl));
+    h->ctl->version = SHM_CTL_VERSION;
+    h->ctl->magic = SHM_CTL_MAGIC;
+  }
+
+  return 0;
+}
+
+static bool shm_has_consumers(struct ShmHandle *h) {
+  for (size_t i = 0; i < SHM_CTL_MAX_CONSUMERS; ++i) {
+    if (h->ctl->consumers[i].pid != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Check which consumers are still busy with the last frame they were notified
+// about, before overwriting the current one. Also cleans up slots of dead
+// consumers. Returns the number of busy consumers.
+static size_t shm_check_consumers(struct ShmHandle *h) {
+  size_t behind = 0;
+  h->consumers_behind = false;
+  for (size_t i = 0; i < SHM_CTL_MAX_CONSUMERS; ++i) {
+    struct ShmCtlConsumer *c = &h->ctl->consumers[i];
+    int32_t pid = c->pid;
+    if (pid == 0) {
+      continue;
+    }
+
+    if ((kill(pid, 0) != 0) && (errno == ESRCH)) {
+      fprintf(stderr, "shm: consumer %d of %s is gone, unregistering\n", pid,
+              h->fname);
+      atomic_compare_exchange_strong(&c->pid, &pid, 0);
+      continue;
+    }
+
+    // Consumers may also have read a newer frame by themselves. Sequence
+    // numbers wrap, so compare their distance.
+    if (h->notified && ((int32_t)(c->consumed_seq - h->notified_seq) < 0)) {
+      h->consumers_behind = true;
+      behind++;
+    }
+  }
+  return behind;
+}
+
+// Start writing a frame of sz bytes: mark the frame as being written, and make
+// sure the shm area is big enough
+static int shm_write_begin(struct ShmHandle *h, size_t sz) {
+  // Before anything can fail, so shm_should_notify doesn't see a stale state
+  const size_t behind = shm_check_consumers(h);
+
+  if (sz > h->max_sz) {
+    fprintf(stderr, "Requested shm data of %zu is bigger than max size %zu\n",
+            sz, h->max_sz);
+    return -ENOMEM;
+  }
+
+  if (sz < MIN_SHM_SZ) {
+    sz = MIN_SHM_SZ;
+  }
+
+  // The current frame will be replaced before these consumers read it
+  h->stats.frames_dropped += behind;
+  h->ctl->dropped_frames += behind;
+  atomic_fetch_add(&h->ctl->frame_seq, 1);
+
+  // Shrinking the file under a consumer that is reading it would SIGBUS it, so
+  // only shrink for legacy consumers that don't know about frame_sz
+  const size_t new_sz = shm_has_consumers(h) && (h->sz > sz) ? h->sz : sz;
+  if ((new_sz == h->sz) && h->ptr) {
+    return 0;
+  }
+
+  if (ftruncate(h->fd, new_sz) < 0) {
+    perror("shm: can't resize");
+    goto err;
+  }
+
+  if (h->ptr) {
+    munmap(h->ptr, h->sz);
+  }
+  h->sz = new_sz;
+  h->ptr = mmap(NULL, h->sz, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+  if (h->ptr == MAP_FAILED) {
+    h->ptr = NULL;
+    perror("shm: can't remmap");
+    goto err;
+  }
+
+  return 0;
+
+err:
+  // Close the seqlock, but the frame contents are now undefined
+  atomic_fetch_add(&h->ctl->frame_seq, 1);
+  return -ENOMEM;
+}
+
+// Copy a frame to the shm area, and return its checksum. The checksum is
+// computed from the source right after copying each chunk, while it's still in
+// cache, so the frame isn't read twice from memory.
+static uint32_t shm_copy_checksum(void *dst, const void *src, size_t sz) {
+  uint32_t checksum = SHM_CTL_CHECKSUM_INIT;
+  for (size_t off = 0; off < sz; off += SHM_COPY_CHUNK_SZ) {
+    const size_t n = sz - off < SHM_COPY_CHUNK_SZ ? sz - off : SHM_COPY_CHUNK_SZ;
+    memcpy((char *)dst + off, (const char *)src + off, n);
+    checksum = shm_ctl_checksum_update(checksum, (const char *)src + off, n);
+  }
+  return checksum;
+}
+
+// Checksum of a frame already in the shm area
+static uint32_t shm_mapped_checksum(struct ShmHandle *h, size_t sz) {
+  return shm_ctl_checksum(h->ptr, sz < MIN_SHM_SZ ? MIN_SHM_SZ : sz);
+}
+
+static void shm_write_end(struct ShmHandle *h, size_t sz, uint32_t checksum) {
+  h->frame_sz = sz < MIN_SHM_SZ ? MIN_SHM_SZ : sz;
+  h->ctl->frame_sz = h->frame_sz;
+  h->ctl->frame_checksum = checksum;
+  // Even again: frame complete
+  atomic_fetch_add(&h->ctl->frame_seq, 1);
+  h->stats.frames_published++;
+}
+
+// Try to keep the frame a previous instance left in the shm area. Only possible
+// if the control block says the frame is complete and its checksum matches.
+static bool shm_adopt_existing(struct ShmHandle *h) {
+  struct stat st;
+  if (fstat(h->fd, &st) < 0) {
+    perror("shm: warm start, can't stat");
+    return false;
+  }
+
+  const uint32_t seq = h->ctl->frame_seq;
+  const size_t frame_sz = h->ctl->frame_sz;
+  const char *reject = NULL;
+  if (seq % 2 != 0) {
+    reject = "frame was being written";
+  } else if ((frame_sz < MIN_SHM_SZ) || (frame_sz > h->max_sz)) {
+    reject = "invalid frame size";
+  } else if ((size_t)st.st_size < frame_sz) {
+    reject = "shm area is smaller than frame";
+  }
+
+  if (reject) {
+    printf("shm: can't warm start %s, %s\n", h->fname, reject);
+    return false;
+  }
+
+  void *ptr =
+      mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
+  if (ptr == MAP_FAILED) {
+    perror("shm: warm start, can't mmap");
+    return false;
+  }
+
+  if (shm_ctl_checksum(ptr, frame_sz) != h->ctl->frame_checksum) {
+    printf("shm: can't warm start %s, frame checksum mismatch\n", h->fname);
+    munmap(ptr, st.st_size);
+    return false;
+  }
+
+  h->ptr = ptr;
+  h->sz = st.st_size;
+  h->frame_sz = frame_sz;
+  printf("shm: warm start, keeping %zu byte frame in %s\n", frame_sz,
+         h->fname);
+  return true;
+}
+
+struct ShmHandle *shm_init(const char *shm_shared_fname, size_t max_sz_bytes,
+                           bool warm_start) {
   struct ShmHandle *h = malloc(sizeof(struct ShmHandle));
   if (!h) {
     perror("shm: handle, bad alloc");
     goto err;
   }
 
+  memset(h, 0, sizeof(struct ShmHandle));
+  h->fd = -1;
+  h->ctl_fd = -1;
   h->fname = strdup(shm_shared_fname);
   if (!h->fname) {
     perror("shm: fname, bad alloc");
     goto err;
   }
 
-  h->fd = 0;
   h->ptr = NULL;
   h->sz = MIN_SHM_SZ;
   h->max_sz = max_sz_bytes;
@@ -70,6 +317,29 @@ struct ShmHandle *shm_init(const char *shm_shared_fname, size_t max_sz_bytes) {
     goto err;
   }
 
+  if (shm_ctl_init(h) != 0) {
+    goto err;
+  }
+
+  if (warm_start && shm_adopt_existing(h)) {
+    return h;
+  }
+
+  // The frame changes (to an empty one)
+  if (h->ctl->frame_seq % 2 == 0) {
+    atomic_fetch_add(&h->ctl->frame_seq, 1);
+  }
+
+  // Consumers still registered in the control block may have the shm area of
+  // a previous instance mapped: shrinking it under them would SIGBUS them, so
+  // keep its size (and let shm_write_begin grow it from there)
+  shm_check_consumers(h);
+  struct stat st;
+  if (shm_has_consumers(h) && (fstat(h->fd, &st) == 0) &&
+      ((size_t)st.st_size > h->sz)) {
+    h->sz = st.st_size;
+  }
+
   if (ftruncate(h->fd, h->sz) < 0) {
     perror("shm: can't resize");
     goto err;
@@ -77,10 +347,13 @@ struct ShmHandle *shm_init(const char *shm_shared_fname, size_t max_sz_bytes) {
 
   h->ptr = mmap(NULL, h->sz, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
   if (h->ptr == MAP_FAILED) {
+    h->ptr = NULL;
     perror("shm: can't mmap");
     goto err;
   }
 
+  shm_write_end(h, MIN_SHM_SZ, shm_mapped_checksum(h, MIN_SHM_SZ));
+  h->stats.frames_published = 0;
   return h;
 
 err:
@@ -89,33 +362,38 @@ err:
 }
 
 int shm_update(struct ShmHandle *h, const void *data, size_t sz) {
-  if (sz > h->max_sz) {
-    fprintf(stderr, "Requested shm data of %zu is bigger than max size %zu\n",
-            sz, h->max_sz);
-    return -ENOMEM;
+  const int ret = shm_write_begin(h, sz);
+  if (ret != 0) {
+    return ret;
   }
 
-  if (sz < MIN_SHM_SZ) {
-    sz = MIN_SHM_SZ;
-  }
+  const uint32_t checksum = data && (sz >= MIN_SHM_SZ)
+                                ? shm_copy_checksum(h->ptr, data, sz)
+                                : shm_mapped_checksum(h, sz);
+  shm_write_end(h, sz, checksum);
+  return 0;
+}
 
-  h->sz = sz;
-  if (ftruncate(h->fd, h->sz) < 0) {
-    perror("shm: can't resize");
-    return -ENOMEM;
+bool shm_should_notify(struct ShmHandle *h) {
+  if (!h->consumers_behind ||
+      (h->consecutive_skipped_notifications >=
+       MAX_CONSECUTIVE_SKIPPED_NOTIFICATIONS)) {
+    h->consecutive_skipped_notifications = 0;
+    return true;
   }
 
-  h->ptr = mmap(h->ptr, h->sz, PROT_READ | PROT_WRITE, MAP_SHARED, h->fd, 0);
-  if (h->ptr == MAP_FAILED) {
-    perror("shm: can't remmap");
-    return -ENOMEM;
-  }
+  h->consecutive_skipped_notifications++;
+  h->stats.notifications_skipped++;
+  return false;
+}
 
-  if (data) {
-    memcpy(h->ptr, data, sz);
-  }
+void shm_on_notified(struct ShmHandle *h) {
+  h->notified = true;
+  h->notified_seq = h->ctl->frame_seq;
+}
 
-  return 0;
+void shm_get_stats(struct ShmHandle *h, struct ShmStats *out) {
+  *out = h->stats;
 }
 
 int shm_update_from_file(struct ShmHandle *h, const char *fpath) {
@@ -139,13 +417,16 @@ int shm_update_from_file(struct ShmHandle *h, const char *fpath) {
     return -ENOENT;
   }
 
-  const int sz_update_ret = shm_update(h, NULL, file_stat.st_size);
+  const int sz_update_ret = shm_write_begin(h, file_stat.st_size);
   if (sz_update_ret != 0) {
     fclose(fp);
     return sz_update_ret;
   }
 
+  // Only used on shutdown, so reading the frame back for the checksum is fine
   const long read_sz = fread(h->ptr, 1, file_stat.st_size, fp);
+  const size_t frame_sz = read_sz > 0 ? read_sz : 0;
+  shm_write_end(h, frame_sz, shm_mapped_checksum(h, frame_sz));
   if (read_sz != file_stat.st_size) {
     fclose(fp);
     perror("shm update: can't read src file");
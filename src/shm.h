@@ -1,10 +1,26 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
+// Image shared with a render process through /dev/shm. Each image comes with a
+// control block that lets consumers read frames without tearing and
+// acknowledge the frames they consumed; see shm_ctl.h.
 struct ShmHandle;
 
-struct ShmHandle *shm_init(const char *shm_shared_fname, size_t max_sz_bytes);
+struct ShmStats {
+  size_t frames_published;
+  // Frames overwritten before a registered consumer got to read them
+  size_t frames_dropped;
+  // Notifications not sent because consumers were still busy
+  size_t notifications_skipped;
+};
+
+// If warm_start is set and the shm area already holds a valid frame (eg left
+// behind by a previous instance, see shm_free_leak_shm), the frame is kept as
+// is. Otherwise the shm area starts empty.
+struct ShmHandle *shm_init(const char *shm_shared_fname, size_t max_sz_bytes,
+                           bool warm_start);
 void shm_free(struct ShmHandle *h);
 void shm_free_leak_shm(struct ShmHandle *h);
 
@@ -17,3 +33,17 @@ int shm_update(struct ShmHandle *h, const void *data, size_t sz);
 // Returns the number of bytes copied on success, 0 if nothing
 // was copied, an error code in any other case
 int shm_update_from_file(struct ShmHandle *h, const char *fpath);
+
+// Should consumers be notified about the last update? False if a consumer that
+// acknowledges frames is still busy with the last frame it was notified about:
+// it will pick up the newest frame by itself once it's done, so there's no need
+// to pile up more work on it. Consumers that don't acknowledge frames are
+// always notified.
+bool shm_should_notify(struct ShmHandle *h);
+
+// Call after notifying consumers about the current frame. Frames that were
+// never notified (eg kept from a previous instance by a warm start, or
+// published on shutdown) don't make consumers look busy.
+void shm_on_notified(struct ShmHandle *h);
+
+void shm_get_stats(struct ShmHandle *h, struct ShmStats *out);
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// Layout of the control block that goes with each shm image (in
+// /dev/shm/<shm_image_file_name>_ctl). Consumers use it to read frames without
+// tearing, and to tell the publisher which frames they already consumed.
+//
+// Publisher protocol (see shm.c):
+//   frame_seq is a seqlock: it's odd while a frame is being written, and even
+//   once the frame (frame_sz bytes at the start of the image shm) is complete.
+//   While at least one consumer is registered, the image shm never shrinks, so
+//   consumers must use frame_sz instead of the file size.
+//
+// Consumer protocol:
+//   1. Register by claiming a free slot: CAS consumers[i].pid from 0 to getpid()
+//   2. On SIGUSR1 (or when polling): read frame_seq; if odd, retry later. Read
+//      frame_sz bytes from the image shm, then read frame_seq again: if it
+//      changed, the frame was torn and must be read again.
+//   3. Once done with the frame, store the frame_seq it read in consumed_seq.
+//      If frame_seq is now newer than consumed_seq, go back to 2: the publisher
+//      doesn't notify consumers that are still busy with an older frame, it
+//      expects them to pick up the newest frame by themselves.
+//   4. Set pid back to 0 on shutdown (the publisher also clears slots of
+//      consumers that died).
+
+#define SHM_CTL_MAGIC 0x4c544341 // "ACTL"
+#define SHM_CTL_VERSION 2
+#define SHM_CTL_MAX_CONSUMERS 4
+#define SHM_CTL_FNAME_SUFFIX "_ctl"
+
+struct ShmCtlConsumer {
+  _Atomic int32_t pid;
+  _Atomic uint32_t consumed_seq;
+};
+
+struct ShmCtl {
+  uint32_t magic;
+  uint32_t version;
+  _Atomic uint32_t frame_seq;
+  _Atomic uint32_t frame_sz;
+  // Frames overwritten before a registered consumer got to read them
+  _Atomic uint32_t dropped_frames;
+  // shm_ctl_checksum of the current frame
+  _Atomic uint32_t frame_checksum;
+  struct ShmCtlConsumer consumers[SHM_CTL_MAX_CONSUMERS];
+};
+
+#define SHM_CTL_CHECKSUM_INIT 2166136261u
+
+// FNV-1a over 32 bit words (plus the trailing bytes): not cryptographic, only
+// meant to catch stale or half written frames, and cheap enough to run on
+// every frame. Can be computed in chunks, continuing from the previous chunk's
+// result, as long as every chunk but the last is a multiple of 4 bytes.
+static inline uint32_t shm_ctl_checksum_update(uint32_t h, const void *data,
+                                               size_t sz) {
+  const unsigned char *p = data;
+  for (; sz >= 4; sz -= 4, p += 4) {
+    uint32_t w;
+    memcpy(&w, p, 4);
+    h = (h ^ w) * 16777619u;
+  }
+  for (; sz > 0; --sz, ++p) {
+    h = (h ^ *p) * 16777619u;
+  }
+  return h;
+}
+
+static inline uint32_t shm_ctl_checksum(const void *data, size_t sz) {
+  return shm_ctl_checksum_update(SHM_CTL_CHECKSUM_INIT, data, sz);
+}
@@ -0,0 +1,328 @@
+// shm_stress: publish frames through shm_update as fast as possible while N
+// reader processes map the same shm area and verify every frame they read.
+// Reports publish throughput, publish-to-read latency and torn/corrupt reads.
+//
+// Usage: shm_stress [-r readers] [-t seconds] [-s min_kb] [-S max_kb] [-l]
+//   -l: readers don't register in the control block, and read the shm file the
+//       way a legacy consumer does (whole file, no seqlock)
+
+#include "shm.h"
+#include "shm_ctl.h"
+#include "time_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define STRESS_SHM_NAME "ambience_shm_stress"
+#define MAX_READERS 32
+// Latency histogram buckets, log2(usec)
+#define LAT_BUCKETS 32
+
+// Each frame starts with this header, the rest is random data
+struct FrameHdr {
+  uint64_t publish_ns;
+  uint64_t idx;
+};
+
+struct ReaderResult {
+  size_t frames_read;
+  // Torn reads detected (and discarded) through the seqlock
+  size_t torn_detected;
+  // Frames that passed the seqlock check (or, for legacy readers, any frame)
+  // but failed the checksum: the reader would have used a broken frame
+  size_t corrupt;
+  // Reads that hit SIGBUS because the file shrunk under the reader
+  size_t truncated;
+  size_t lat_samples;
+  uint64_t lat_sum_us;
+  uint64_t lat_max_us;
+  size_t lat_hist[LAT_BUCKETS];
+};
+
+static sigjmp_buf g_sigbus_jmp;
+static void on_sigbus(int sig) { siglongjmp(g_sigbus_jmp, 1); }
+
+static void reader_record_latency(struct ReaderResult *res,
+                                  const struct FrameHdr *hdr) {
+  const uint64_t lat_us = (time_now_ns() - hdr->publish_ns) / 1000;
+  size_t bucket = 0;
+  while ((bucket + 1 < LAT_BUCKETS) && ((1ull << (bucket + 1)) <= lat_us)) {
+    bucket++;
+  }
+  res->lat_hist[bucket]++;
+  res->lat_samples++;
+  res->lat_sum_us += lat_us;
+  res->lat_max_us = lat_us > res->lat_max_us ? lat_us : res->lat_max_us;
+}
+
+static void reader_run(size_t max_sz, uint64_t deadline_ns, bool legacy,
+                       int result_fd) {
+  struct ReaderResult res;
+  memset(&res, 0, sizeof(res));
+
+  int fd = shm_open(STRESS_SHM_NAME, O_RDONLY, 0);
+  int ctl_fd = shm_open(STRESS_SHM_NAME SHM_CTL_FNAME_SUFFIX, O_RDWR, 0);
+  if ((fd < 0) || (ctl_fd < 0)) {
+    perror("reader: can't open shm");
+    exit(1);
+  }
+
+  // Map the max size once: pages past the end of the file are only a problem
+  // if we touch them
+  const unsigned char *img = mmap(NULL, max_sz, PROT_READ, MAP_SHARED, fd, 0);
+  struct ShmCtl *ctl = mmap(NULL, sizeof(struct ShmCtl),
+                            PROT_READ | PROT_WRITE, MAP_SHARED, ctl_fd, 0);
+  unsigned char *frame = malloc(max_sz);
+  if ((img == MAP_FAILED) || (ctl == MAP_FAILED) || !frame) {
+    perror("reader: can't map shm");
+    exit(1);
+  }
+
+  struct ShmCtlConsumer *slot = NULL;
+  for (size_t i = 0; !legacy && i < SHM_CTL_MAX_CONSUMERS; ++i) {
+    int32_t expected = 0;
+    if (atomic_compare_exchange_strong(&ctl->consumers[i].pid, &expected,
+                                       getpid())) {
+      slot = &ctl->consumers[i];
+      break;
+    }
+  }
+
+  signal(SIGBUS, on_sigbus);
+  uint32_t last_seq = 0;
+  while (time_now_ns() < deadline_ns) {
+    // Legacy consumers don't know about the seqlock, they read whenever
+    // there's a new frame
+    const uint32_t seq = atomic_load(&ctl->frame_seq);
+    if ((!legacy && (seq % 2 != 0)) || (seq == last_seq)) {
+      // Nothing new, or frame being written
+      usleep(0);
+      continue;
+    }
+
+    size_t sz;
+    if (legacy) {
+      struct stat st;
+      fstat(fd, &st);
+      sz = st.st_size < max_sz ? st.st_size : max_sz;
+    } else {
+      sz = atomic_load(&ctl->frame_sz);
+      sz = sz < max_sz ? sz : max_sz;
+    }
+    const uint32_t checksum = atomic_load(&ctl->frame_checksum);
+
+    if (sigsetjmp(g_sigbus_jmp, 1)) {
+      res.truncated++;
+      last_seq = seq;
+      continue;
+    }
+    memcpy(frame, img, sz);
+
+    atomic_thread_fence(memory_order_acquire);
+    if (!legacy && (atomic_load(&ctl->frame_seq) != seq)) {
+      res.torn_detected++;
+      continue;
+    }
+
+    last_seq = seq;
+    if (shm_ctl_checksum(frame, sz) != checksum) {
+      res.corrupt++;
+      continue;
+    }
+
+    res.frames_read++;
+    if (sz >= sizeof(struct FrameHdr)) {
+      reader_record_latency(&res, (const struct FrameHdr *)frame);
+    }
+
+    if (slot) {
+      atomic_store(&slot->consumed_seq, seq);
+    }
+  }
+
+  if (slot) {
+    atomic_store(&slot->pid, 0);
+  }
+
+  if (write(result_fd, &res, sizeof(res)) != sizeof(res)) {
+    perror("reader: can't report results");
+  }
+  exit(0);
+}
+
+static size_t lat_percentile_us(const struct ReaderResult *r, double pct) {
+  size_t target = r->lat_samples * pct;
+  size_t seen = 0;
+  for (size_t i = 0; i < LAT_BUCKETS; ++i) {
+    seen += r->lat_hist[i];
+    if (seen > target) {
+      return 1ull << (i + 1);
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  size_t n_readers = 4;
+  size_t duration_sec = 5;
+  size_t min_kb = 1;
+  size_t max_kb = 2048;
+  bool legacy = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:t:s:S:l")) != -1) {
+    switch (opt) {
+    case 'r': n_readers = strtoul(optarg, NULL, 10); break;
+    case 't': duration_sec = strtoul(optarg, NULL, 10); break;
+    case 's': min_kb = strtoul(optarg, NULL, 10); break;
+    case 'S': max_kb = strtoul(optarg, NULL, 10); break;
+    case 'l': legacy = true; break;
+    default:
+      fprintf(stderr, "Usage: %s [-r readers] [-t seconds] [-s min_kb] "
+                      "[-S max_kb] [-l]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  if ((n_readers == 0) || (n_readers > MAX_READERS) || (min_kb == 0) ||
+      (min_kb > max_kb)) {
+    fprintf(stderr, "Invalid arguments\n");
+    return 1;
+  }
+
+  const size_t max_sz = max_kb * 1024;
+  unsigned char *buf = malloc(max_sz);
+  if (!buf) {
+    perror("Can't alloc frame buffer");
+    return 1;
+  }
+  unsigned seed = 42;
+  for (size_t i = 0; i < max_sz; ++i) {
+    buf[i] = rand_r(&seed);
+  }
+
+  // Don't pick up a control block from a previous run
+  shm_unlink(STRESS_SHM_NAME);
+  shm_unlink(STRESS_SHM_NAME SHM_CTL_FNAME_SUFFIX);
+  struct ShmHandle *shm = shm_init(STRESS_SHM_NAME, max_sz, false);
+  if (!shm) {
+    return 1;
+  }
+
+  printf("shm_stress: %zu %s readers, frames of %zu-%zu KB, %zu seconds\n",
+         n_readers, legacy ? "legacy" : "registered", min_kb, max_kb,
+         duration_sec);
+  // Don't let readers inherit buffered output
+  fflush(stdout);
+
+  // Give readers some time to start and register before publishing
+  const uint64_t start_ns = time_now_ns() + 200 * 1000000ull;
+  const uint64_t deadline_ns = start_ns + duration_sec * 1000000000ull;
+  int result_fds[MAX_READERS];
+  pid_t pids[MAX_READERS];
+  for (size_t i = 0; i < n_readers; ++i) {
+    int fds[2];
+    if (pipe(fds) < 0) {
+      perror("Can't create pipe");
+      return 1;
+    }
+
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      perror("Can't fork reader");
+      return 1;
+    } else if (pids[i] == 0) {
+      close(fds[0]);
+      reader_run(max_sz, deadline_ns, legacy, fds[1]);
+    }
+    close(fds[1]);
+    result_fds[i] = fds[0];
+  }
+
+  while (time_now_ns() < start_ns) {
+    usleep(1000);
+  }
+
+  size_t published = 0;
+  size_t published_bytes = 0;
+  size_t failed = 0;
+  uint64_t publish_ns_total = 0;
+  while (time_now_ns() < deadline_ns) {
+    const size_t sz = (min_kb + rand_r(&seed) % (max_kb - min_kb + 1)) * 1024;
+    struct FrameHdr hdr = {.publish_ns = time_now_ns(), .idx = published};
+    memcpy(buf, &hdr, sizeof(hdr));
+
+    const uint64_t t0 = time_now_ns();
+    if (shm_update(shm, buf, sz) != 0) {
+      failed++;
+      continue;
+    }
+    publish_ns_total += time_now_ns() - t0;
+    // Readers poll for every frame, as if they had been notified about it
+    shm_on_notified(shm);
+    published++;
+    published_bytes += sz;
+  }
+
+  struct ReaderResult total;
+  memset(&total, 0, sizeof(total));
+  for (size_t i = 0; i < n_readers; ++i) {
+    struct ReaderResult r;
+    if (read(result_fds[i], &r, sizeof(r)) != sizeof(r)) {
+      fprintf(stderr, "Reader %zu didn't report results\n", i);
+      continue;
+    }
+    close(result_fds[i]);
+    waitpid(pids[i], NULL, 0);
+
+    total.frames_read += r.frames_read;
+    total.torn_detected += r.torn_detected;
+    total.corrupt += r.corrupt;
+    total.truncated += r.truncated;
+    total.lat_samples += r.lat_samples;
+    total.lat_sum_us += r.lat_sum_us;
+    total.lat_max_us = r.lat_max_us > total.lat_max_us ? r.lat_max_us
+                                                       : total.lat_max_us;
+    for (size_t b = 0; b < LAT_BUCKETS; ++b) {
+      total.lat_hist[b] += r.lat_hist[b];
+    }
+  }
+
+  struct ShmStats stats;
+  shm_get_stats(shm, &stats);
+  shm_free(shm);
+  free(buf);
+
+  const double secs = duration_sec;
+  printf("Publisher: %zu frames (%.1f/s, %.1f MB/s), avg shm_update %.1f us, "
+         "%zu failed, %zu dropped for busy readers\n",
+         published, published / secs, published_bytes / secs / 1024 / 1024,
+         published ? publish_ns_total / 1000.0 / published : 0.0, failed,
+         stats.frames_dropped);
+  printf("Readers: %zu frames read, %zu torn reads detected, %zu truncated "
+         "(SIGBUS), %zu corrupt\n",
+         total.frames_read, total.torn_detected, total.truncated,
+         total.corrupt);
+  if (total.lat_samples > 0) {
+    printf("Publish to read latency: avg %.1f us, p50 < %zu us, p99 < %zu us, "
+           "max %llu us\n",
+           (double)total.lat_sum_us / total.lat_samples,
+           lat_percentile_us(&total, 0.5), lat_percentile_us(&total, 0.99),
+           (unsigned long long)total.lat_max_us);
+  }
+
+  // Detected torn reads are fine, the protocol handles them; frames that pass
+  // the protocol checks but are broken are not
+  return (!legacy && (total.corrupt + total.truncated > 0)) ? 2 : 0;
+}
@@ -0,0 +1,280 @@
+#include "slide_record.h"
+#include "time_utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+struct SlideRecorder {
+  int fd;
+  uint32_t session;
+  uint64_t session_start_ms;
+};
+
+struct SlideReplay {
+  const unsigned char *map;
+  size_t map_sz;
+  size_t pos;
+};
+
+// Find the last session in an existing recording, so the new one gets a new
+// number, and where its last complete record ends. Also checks the file is a
+// recording.
+static bool slide_record_scan(int fd, uint32_t *session, off_t *valid_end) {
+  *session = 0;
+  *valid_end = 0;
+  struct stat st;
+  if (fstat(fd, &st) < 0) {
+    return false;
+  }
+  if (st.st_size == 0) {
+    return true;
+  }
+
+  struct SlideRecordFileHeader fhdr;
+  if ((pread(fd, &fhdr, sizeof(fhdr), 0) != sizeof(fhdr)) ||
+      (fhdr.magic != SLIDE_RECORD_MAGIC) ||
+      (fhdr.version != SLIDE_RECORD_VERSION)) {
+    return false;
+  }
+
+  off_t pos = sizeof(fhdr);
+  struct SlideRecordHeader hdr;
+  while (pread(fd, &hdr, sizeof(hdr), pos) == sizeof(hdr)) {
+    const off_t end =
+        pos + sizeof(hdr) + (off_t)hdr.img_sz + hdr.meta_sz + 1 + hdr.qr_sz;
+    if ((hdr.magic != SLIDE_RECORD_MAGIC) || (end > st.st_size)) {
+      break;
+    }
+    *session = hdr.session;
+    pos = end;
+  }
+
+  *valid_end = pos;
+  return true;
+}
+
+struct SlideRecorder *slide_record_open(const char *path) {
+  struct SlideRecorder *h = malloc(sizeof(struct SlideRecorder));
+  if (!h) {
+    perror("slide_record: bad alloc");
+    return NULL;
+  }
+
+  memset(h, 0, sizeof(struct SlideRecorder));
+  h->fd = open(path, O_CREAT | O_RDWR | O_APPEND | O_CLOEXEC, 0644);
+  if (h->fd < 0) {
+    perror("slide_record: can't open recording");
+    goto err;
+  }
+
+  uint32_t last_session;
+  off_t valid_end;
+  if (!slide_record_scan(h->fd, &last_session, &valid_end)) {
+    fprintf(stderr, "slide_record: %s exists and isn't a slide recording\n",
+            path);
+    goto err;
+  }
+
+  // A previous session may have died halfway through a record: drop it, or
+  // replays would stop there and never get to the new session
+  const off_t file_sz = lseek(h->fd, 0, SEEK_END);
+  if ((valid_end > 0) && (file_sz > valid_end)) {
+    fprintf(stderr, "slide_record: dropping %lld bytes of broken record(s) "
+                    "at the end of %s\n",
+            (long long)(file_sz - valid_end), path);
+    if (ftruncate(h->fd, valid_end) < 0) {
+      perror("slide_record: can't truncate recording");
+      goto err;
+    }
+  }
+
+  if (lseek(h->fd, 0, SEEK_END) == 0) {
+    const struct SlideRecordFileHeader fhdr = {.magic = SLIDE_RECORD_MAGIC,
+                                               .version = SLIDE_RECORD_VERSION};
+    if (write(h->fd, &fhdr, sizeof(fhdr)) != sizeof(fhdr)) {
+      perror("slide_record: can't write recording header");
+      goto err;
+    }
+  }
+
+  h->session = last_session + 1;
+  h->session_start_ms = time_now_ms();
+  printf("slide_record: recording session %u to %s\n", h->session, path);
+  return h;
+
+err:
+  slide_record_close(h);
+  return NULL;
+}
+
+void slide_record_close(struct SlideRecorder *h) {
+  if (!h) {
+    return;
+  }
+
+  if (h->fd >= 0) {
+    close(h->fd);
+  }
+  free(h);
+}
+
+int slide_record_write(struct SlideRecorder *h, size_t fetch_ms,
+                       const void *img, size_t img_sz, const char *meta,
+                       size_t meta_sz, const void *qr, size_t qr_sz) {
+  if (!img || (!qr && qr_sz) || (img_sz > UINT32_MAX) ||
+      (meta_sz > UINT32_MAX) || (qr_sz > UINT32_MAX)) {
+    return -EINVAL;
+  }
+
+  // libwwwslide may or may not count the terminator in meta_sz
+  if (meta && (meta_sz > 0) && (meta[meta_sz - 1] == '\0')) {
+    meta_sz--;
+  }
+  if (!meta) {
+    meta_sz = 0;
+  }
+
+  const struct SlideRecordHeader hdr = {
+      .magic = SLIDE_RECORD_MAGIC,
+      .session = h->session,
+      .session_ms = time_now_ms() - h->session_start_ms,
+      .fetch_ms = fetch_ms,
+      .img_sz = img_sz,
+      .meta_sz = meta_sz,
+      .qr_sz = qr_sz,
+  };
+  struct iovec iov[] = {
+      {.iov_base = (void *)&hdr, .iov_len = sizeof(hdr)},
+      {.iov_base = (void *)img, .iov_len = img_sz},
+      {.iov_base = (void *)meta, .iov_len = meta_sz},
+      {.iov_base = "", .iov_len = 1},
+      {.iov_base = (void *)qr, .iov_len = qr_sz},
+  };
+  const size_t total_sz = sizeof(hdr) + img_sz + meta_sz + 1 + qr_sz;
+  // Where this record starts, to drop it if it's only partially written
+  const off_t record_start = lseek(h->fd, 0, SEEK_END);
+  if (record_start < 0) {
+    return -errno;
+  }
+
+  // A single append: a crash can only leave a truncated record at the end,
+  // which replay ignores
+  const ssize_t written = writev(h->fd, iov, sizeof(iov) / sizeof(iov[0]));
+  if (written < 0) {
+    return -errno;
+  }
+  if ((size_t)written != total_sz) {
+    // Eg out of disk space. Records after a partial one would be unreachable
+    // for replay, so don't leave it behind.
+    fprintf(stderr, "slide_record: short write (%zd of %zu bytes), dropping "
+                    "partial record\n",
+            written, total_sz);
+    if (ftruncate(h->fd, record_start) < 0) {
+      perror("slide_record: can't truncate partial record");
+    }
+    return -EIO;
+  }
+  return 0;
+}
+
+struct SlideReplay *slide_replay_open(const char *path) {
+  struct SlideReplay *h = malloc(sizeof(struct SlideReplay));
+  if (!h) {
+    perror("slide_replay: bad alloc");
+    return NULL;
+  }
+  memset(h, 0, sizeof(struct SlideReplay));
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    perror("slide_replay: can't open recording");
+    goto err;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) < 0) ||
+      ((size_t)st.st_size < sizeof(struct SlideRecordFileHeader))) {
+    fprintf(stderr, "slide_replay: %s is empty or can't be read\n", path);
+    close(fd);
+    goto err;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    perror("slide_replay: can't mmap recording");
+    goto err;
+  }
+  h->map = map;
+  h->map_sz = st.st_size;
+
+  struct SlideRecordFileHeader fhdr;
+  memcpy(&fhdr, h->map, sizeof(fhdr));
+  if ((fhdr.magic != SLIDE_RECORD_MAGIC) ||
+      (fhdr.version != SLIDE_RECORD_VERSION)) {
+    fprintf(stderr, "slide_replay: %s isn't a slide recording\n", path);
+    goto err;
+  }
+
+  h->pos = sizeof(fhdr);
+  return h;
+
+err:
+  slide_replay_close(h);
+  return NULL;
+}
+
+void slide_replay_close(struct SlideReplay *h) {
+  if (!h) {
+    return;
+  }
+
+  if (h->map) {
+    munmap((void *)h->map, h->map_sz);
+  }
+  free(h);
+}
+
+bool slide_replay_next(struct SlideReplay *h, struct SlideRecord *out) {
+  struct SlideRecordHeader hdr;
+  if (h->map_sz - h->pos < sizeof(hdr)) {
+    return false;
+  }
+
+  // Records aren't aligned
+  memcpy(&hdr, h->map + h->pos, sizeof(hdr));
+  const size_t payload_sz =
+      (size_t)hdr.img_sz + hdr.meta_sz + 1 + (size_t)hdr.qr_sz;
+  if ((hdr.magic != SLIDE_RECORD_MAGIC) ||
+      (h->map_sz - h->pos - sizeof(hdr) < payload_sz)) {
+    fprintf(stderr, "slide_replay: broken record at offset %zu, stopping\n",
+            h->pos);
+    return false;
+  }
+
+  const unsigned char *p = h->map + h->pos + sizeof(hdr);
+  out->session = hdr.session;
+  out->session_ms = hdr.session_ms;
+  out->fetch_ms = hdr.fetch_ms;
+  out->img = p;
+  out->img_sz = hdr.img_sz;
+  p += hdr.img_sz;
+  out->meta = hdr.meta_sz ? (const char *)p : NULL;
+  out->meta_sz = hdr.meta_sz;
+  p += hdr.meta_sz + 1;
+  out->qr = hdr.qr_sz ? p : NULL;
+  out->qr_sz = hdr.qr_sz;
+  h->pos += sizeof(hdr) + payload_sz;
+  return true;
+}
+
+void slide_replay_rewind(struct SlideReplay *h) {
+  h->pos = sizeof(struct SlideRecordFileHeader);
+}
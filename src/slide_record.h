@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Record the slides received from the image service to a file, and play them
+// back later: this lets the whole pipeline run offline, deterministically, and
+// as fast as it can go.
+//
+// File format: a SlideRecordFileHeader, then one SlideRecordHeader per slide,
+// each followed by img_sz bytes of image, meta_sz bytes of metadata plus a NUL
+// terminator, and qr_sz bytes of QR image. Integers are in host byte order.
+// Files are only ever appended to, so a recording may span several runs of the
+// service (each one a new session).
+#define SLIDE_RECORD_MAGIC 0x43525341 // "ASRC"
+#define SLIDE_RECORD_VERSION 1
+
+struct SlideRecordFileHeader {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct SlideRecordHeader {
+  uint32_t magic;
+  // Incremented every time the service starts recording to this file
+  uint32_t session;
+  // Time since the recording session started, when the slide was received
+  uint64_t session_ms;
+  // Time between requesting the slide and receiving it
+  uint32_t fetch_ms;
+  uint32_t img_sz;
+  uint32_t meta_sz;
+  uint32_t qr_sz;
+};
+
+// A slide read from a recording. Pointers are valid until slide_replay_close.
+struct SlideRecord {
+  uint32_t session;
+  uint64_t session_ms;
+  uint32_t fetch_ms;
+  const void *img;
+  size_t img_sz;
+  // NULL if the slide had no metadata, NUL terminated otherwise
+  const char *meta;
+  size_t meta_sz;
+  const void *qr;
+  size_t qr_sz;
+};
+
+struct SlideRecorder;
+
+// Start a new recording session, appending to path (which is created if needed)
+struct SlideRecorder *slide_record_open(const char *path);
+void slide_record_close(struct SlideRecorder *h);
+
+// Append a slide. Returns 0 on success, an error code in any other case
+int slide_record_write(struct SlideRecorder *h, size_t fetch_ms,
+                       const void *img, size_t img_sz, const char *meta,
+                       size_t meta_sz, const void *qr, size_t qr_sz);
+
+struct SlideReplay;
+
+struct SlideReplay *slide_replay_open(const char *path);
+void slide_replay_close(struct SlideReplay *h);
+
+// Read the next slide. Returns false at the end of the recording, or if the
+// rest of the recording is broken (eg the service died while writing a slide)
+bool slide_replay_next(struct SlideReplay *h, struct SlideRecord *out);
+
+// Go back to the first slide
+void slide_replay_rewind(struct SlideReplay *h);
@@ -0,0 +1,381 @@
+// ambiencesvc-standin: local stand-in for the image service, to run the whole
+// service offline (see loadtest.sh). It doesn't implement the image
+// service protocol: it serves canned responses from a fixture directory, so
+// any request libwwwslide makes can be answered by dropping a file in the right
+// place.
+//
+// A request for /some/path (any method; query strings and request bodies are
+// ignored) is answered with:
+//   - fixtures/some/path, if it's a file
+//   - the next file from fixtures/some/path, if it's a directory: files are
+//     served in name order, round robin, so a directory of images plays as a
+//     slideshow. Each directory keeps its own position.
+//   - 404 otherwise
+//
+// Usage: ambiencesvc-standin -d fixtures [-p port] [-l latency_ms]
+//                            [-j jitter_ms] [-b kbytes_per_sec] [-e error_pct]
+//   -l/-j: delay every response by latency_ms plus up to jitter_ms
+//   -b: throttle response bodies to this bandwidth
+//   -e: answer this percentage of requests with a 503
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define DEFAULT_PORT 5000
+#define MAX_REQUEST_HDR_SZ 8192
+#define MAX_PATH_SZ 1024
+#define MAX_DIR_FILES 4096
+#define MAX_DIRS 64
+// Bandwidth throttling granularity
+#define THROTTLE_TICK_USEC (50 * 1000)
+
+struct StandinCfg {
+  const char *fixtures;
+  size_t latency_ms;
+  size_t jitter_ms;
+  size_t bytes_per_sec;
+  size_t error_pct;
+};
+
+// Round robin position of each fixture directory
+struct DirPos {
+  char path[MAX_PATH_SZ];
+  size_t next;
+};
+
+static struct StandinCfg g_cfg;
+static pthread_mutex_t g_dirs_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct DirPos g_dirs[MAX_DIRS];
+static size_t g_dirs_count = 0;
+
+static const char *content_type(const char *path) {
+  static const struct {
+    const char *ext;
+    const char *type;
+  } types[] = {
+      {".jpg", "image/jpeg"},        {".jpeg", "image/jpeg"},
+      {".png", "image/png"},         {".json", "application/json"},
+      {".txt", "text/plain"},        {".html", "text/html"},
+  };
+  const char *ext = strrchr(path, '.');
+  for (size_t i = 0; ext && i < sizeof(types) / sizeof(types[0]); ++i) {
+    if (strcasecmp(ext, types[i].ext) == 0) {
+      return types[i].type;
+    }
+  }
+  return "application/octet-stream";
+}
+
+static int cmp_str(const void *a, const void *b) {
+  return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// Pick the next file of a fixture directory. Returns false if it has no files.
+static bool dir_next_file(const char *dir, char *out, size_t out_sz) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    return false;
+  }
+
+  // Re-read the directory every time, so fixtures can change while running
+  char *names[MAX_DIR_FILES];
+  size_t n = 0;
+  struct dirent *e;
+  while ((n < MAX_DIR_FILES) && (e = readdir(d))) {
+    if ((e->d_name[0] != '.') && (e->d_type == DT_REG || e->d_type == DT_LNK ||
+                                  e->d_type == DT_UNKNOWN)) {
+      names[n] = strdup(e->d_name);
+      n += names[n] != NULL;
+    }
+  }
+  closedir(d);
+
+  if (n == 0) {
+    return false;
+  }
+  qsort(names, n, sizeof(char *), cmp_str);
+
+  pthread_mutex_lock(&g_dirs_mtx);
+  struct DirPos *pos = NULL;
+  for (size_t i = 0; i < g_dirs_count; ++i) {
+    if (strcmp(g_dirs[i].path, dir) == 0) {
+      pos = &g_dirs[i];
+      break;
+    }
+  }
+  if (!pos && (g_dirs_count < MAX_DIRS)) {
+    pos = &g_dirs[g_dirs_count++];
+    snprintf(pos->path, sizeof(pos->path), "%s", dir);
+    pos->next = 0;
+  }
+  const size_t idx = pos ? pos->next++ % n : 0;
+  pthread_mutex_unlock(&g_dirs_mtx);
+
+  snprintf(out, out_sz, "%s/%s", dir, names[idx]);
+  for (size_t i = 0; i < n; ++i) {
+    free(names[i]);
+  }
+  return true;
+}
+
+// Map a request path to a fixture file. Returns false if there's none.
+static bool resolve_fixture(const char *req_path, char *out, size_t out_sz) {
+  if (strstr(req_path, "..")) {
+    return false;
+  }
+
+  char path[MAX_PATH_SZ];
+  const size_t len = strcspn(req_path, "?#");
+  snprintf(path, sizeof(path), "%s/%.*s", g_cfg.fixtures, (int)len, req_path);
+  // Trailing slashes would make directory lookups fail
+  for (size_t l = strlen(path); (l > 1) && (path[l - 1] == '/'); --l) {
+    path[l - 1] = '\0';
+  }
+
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    return false;
+  }
+  if (S_ISDIR(st.st_mode)) {
+    return dir_next_file(path, out, out_sz);
+  }
+  snprintf(out, out_sz, "%s", path);
+  return S_ISREG(st.st_mode);
+}
+
+static bool send_all(int fd, const void *data, size_t sz) {
+  const char *p = data;
+  while (sz > 0) {
+    const ssize_t n = send(fd, p, sz, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    sz -= n;
+  }
+  return true;
+}
+
+static bool send_body(int fd, const void *data, size_t sz) {
+  if (g_cfg.bytes_per_sec == 0) {
+    return send_all(fd, data, sz);
+  }
+
+  const size_t chunk_sz =
+      g_cfg.bytes_per_sec * THROTTLE_TICK_USEC / (1000 * 1000) + 1;
+  const char *p = data;
+  while (sz > 0) {
+    const size_t n = sz < chunk_sz ? sz : chunk_sz;
+    if (!send_all(fd, p, n)) {
+      return false;
+    }
+    p += n;
+    sz -= n;
+    if (sz > 0) {
+      usleep(THROTTLE_TICK_USEC);
+    }
+  }
+  return true;
+}
+
+static bool send_response(int fd, int status, const char *status_msg,
+                          const char *type, const void *body, size_t body_sz) {
+  char hdr[256];
+  const int hdr_sz = snprintf(hdr, sizeof(hdr),
+                              "HTTP/1.1 %d %s\r\n"
+                              "Content-Type: %s\r\n"
+                              "Content-Length: %zu\r\n"
+                              "\r\n",
+                              status, status_msg, type, body_sz);
+  return send_all(fd, hdr, hdr_sz) && send_body(fd, body, body_sz);
+}
+
+static void *read_file(const char *path, size_t *sz) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    return NULL;
+  }
+
+  struct stat st;
+  void *data = NULL;
+  if ((fstat(fileno(fp), &st) == 0) && (data = malloc(st.st_size + 1))) {
+    *sz = fread(data, 1, st.st_size, fp);
+  }
+  fclose(fp);
+  return data;
+}
+
+// Answer a single request. Returns false if the connection should be closed.
+static bool handle_request(int fd, const char *req) {
+  char method[16], path[MAX_PATH_SZ];
+  if (sscanf(req, "%15s %1023s", method, path) != 2) {
+    send_response(fd, 400, "Bad Request", "text/plain", "", 0);
+    return false;
+  }
+
+  const size_t delay_ms =
+      g_cfg.latency_ms + (g_cfg.jitter_ms ? rand() % (g_cfg.jitter_ms + 1) : 0);
+  if (delay_ms) {
+    usleep(delay_ms * 1000);
+  }
+
+  if ((size_t)(rand() % 100) < g_cfg.error_pct) {
+    printf("%s %s -> 503 (injected)\n", method, path);
+    return send_response(fd, 503, "Service Unavailable", "text/plain", "", 0);
+  }
+
+  char fixture[MAX_PATH_SZ * 2];
+  size_t body_sz = 0;
+  void *body = NULL;
+  if (resolve_fixture(path, fixture, sizeof(fixture))) {
+    body = read_file(fixture, &body_sz);
+  }
+
+  if (!body) {
+    printf("%s %s -> 404\n", method, path);
+    return send_response(fd, 404, "Not Found", "text/plain", "", 0);
+  }
+
+  printf("%s %s -> %s (%zu bytes)\n", method, path, fixture, body_sz);
+  const bool ok =
+      send_response(fd, 200, "OK", content_type(fixture), body, body_sz);
+  free(body);
+  return ok;
+}
+
+static void *handle_conn(void *usr) {
+  const int fd = (int)(intptr_t)usr;
+  char buf[MAX_REQUEST_HDR_SZ + 1];
+  size_t buf_sz = 0;
+  buf[0] = '\0';
+  bool keep_alive = true;
+  while (keep_alive) {
+    char *hdr_end = NULL;
+    while (!(hdr_end = strstr(buf, "\r\n\r\n"))) {
+      if (buf_sz == MAX_REQUEST_HDR_SZ) {
+        goto out;
+      }
+      const ssize_t n = recv(fd, buf + buf_sz, MAX_REQUEST_HDR_SZ - buf_sz, 0);
+      if (n <= 0) {
+        goto out;
+      }
+      buf_sz += n;
+      buf[buf_sz] = '\0';
+    }
+
+    const size_t hdr_sz = hdr_end + 4 - buf;
+    size_t body_sz = 0;
+    const char *cl = strcasestr(buf, "\r\nContent-Length:");
+    if (cl && (cl < hdr_end)) {
+      body_sz = strtoul(cl + strlen("\r\nContent-Length:"), NULL, 10);
+    }
+    const char *conn_close = strcasestr(buf, "\r\nConnection: close");
+    keep_alive = handle_request(fd, buf) &&
+                 !(conn_close && (conn_close < hdr_end));
+
+    // Drop the request body, and keep whatever comes after it (pipelining)
+    size_t consumed = hdr_sz;
+    while (keep_alive && (buf_sz - consumed < body_sz)) {
+      body_sz -= buf_sz - consumed;
+      consumed = buf_sz = 0;
+      const ssize_t n = recv(fd, buf, MAX_REQUEST_HDR_SZ, 0);
+      if (n <= 0) {
+        goto out;
+      }
+      buf_sz = n;
+    }
+    consumed += body_sz;
+    memmove(buf, buf + consumed, buf_sz - consumed);
+    buf_sz -= consumed;
+    buf[buf_sz] = '\0';
+  }
+
+out:
+  close(fd);
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  size_t port = DEFAULT_PORT;
+  size_t kbytes_per_sec = 0;
+  memset(&g_cfg, 0, sizeof(g_cfg));
+  int opt;
+  while ((opt = getopt(argc, argv, "d:p:l:j:b:e:")) != -1) {
+    switch (opt) {
+    case 'd': g_cfg.fixtures = optarg; break;
+    case 'p': port = strtoul(optarg, NULL, 10); break;
+    case 'l': g_cfg.latency_ms = strtoul(optarg, NULL, 10); break;
+    case 'j': g_cfg.jitter_ms = strtoul(optarg, NULL, 10); break;
+    case 'b': kbytes_per_sec = strtoul(optarg, NULL, 10); break;
+    case 'e': g_cfg.error_pct = strtoul(optarg, NULL, 10); break;
+    default:
+      fprintf(stderr, "Usage: %s -d fixtures [-p port] [-l latency_ms] "
+                      "[-j jitter_ms] [-b kbytes_per_sec] [-e error_pct]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  g_cfg.bytes_per_sec = kbytes_per_sec * 1024;
+
+  if (!g_cfg.fixtures || (port == 0) || (port > 65535) ||
+      (g_cfg.error_pct > 100)) {
+    fprintf(stderr, "Invalid arguments, fixture directory is required\n");
+    return 1;
+  }
+
+  int srv = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  const int one = 1;
+  if (srv >= 0) {
+    setsockopt(srv, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  }
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if ((srv < 0) || (bind(srv, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+      (listen(srv, 16) < 0)) {
+    perror("Can't listen");
+    return 1;
+  }
+
+  // Logs are read by a script, don't keep them in a buffer
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  printf("Serving %s on 127.0.0.1:%zu (latency %zu+%zu ms, %zu KB/s, %zu%% "
+         "errors)\n",
+         g_cfg.fixtures, port, g_cfg.latency_ms, g_cfg.jitter_ms,
+         kbytes_per_sec, g_cfg.error_pct);
+
+  while (true) {
+    const int fd = accept4(srv, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno != EINTR) {
+        perror("Can't accept");
+      }
+      continue;
+    }
+
+    pthread_t th;
+    if (pthread_create(&th, NULL, handle_conn, (void *)(intptr_t)fd) != 0) {
+      perror("Can't create connection thread");
+      close(fd);
+      continue;
+    }
+    pthread_detach(th);
+  }
+}
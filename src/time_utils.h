@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stdint.h>
+#include <time.h>
+
+// Monotonic clock helpers, for measuring latencies (not for wall clock time)
+
+static inline uint64_t time_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline uint64_t time_now_ms(void) { return time_now_ns() / 1000000ull; }
@@ -0,0 +1,195 @@
+#include "trace.h"
+#include "time_utils.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define TRACE_RING_SZ                                                          \
+  (sizeof(struct TraceRing) + TRACE_RING_CAPACITY * sizeof(struct TraceEvent))
+
+_Static_assert((TRACE_RING_CAPACITY & (TRACE_RING_CAPACITY - 1)) == 0,
+               "Trace ring capacity must be a power of 2");
+
+static const char *g_event_names[] = {
+    "none",
+    "slide_requested",
+    "slide_received",
+    "meta_parsed",
+    "meta_parse_failed",
+    "shm_published",
+    "shm_publish_failed",
+    "renderer_notified",
+    "renderer_not_found",
+    "renderer_pid_stale",
+    "slide_allocs",
+    "renderer_notify_skipped",
+    "memfd_published",
+    "memfd_publish_failed",
+    "revgeo_lookup",
+    "power_cycle",
+    "power_over_budget",
+    "stage_mem",
+    "slide_mem",
+    "stage_perf",
+};
+_Static_assert(sizeof(g_event_names) / sizeof(g_event_names[0]) ==
+                   TRACE_EV_COUNT,
+               "Missing trace event names");
+
+static struct TraceRing *g_ring = NULL;
+
+// Log rate limit state. Not limited until trace_init is called.
+static size_t g_log_max_lines_per_min = SIZE_MAX;
+static atomic_uint_fast64_t g_log_window_start_ms = 0;
+static atomic_size_t g_log_window_lines = 0;
+static atomic_size_t g_log_suppressed_lines = 0;
+
+int trace_init(const char *shm_name, size_t log_max_lines_per_min) {
+  g_log_max_lines_per_min = log_max_lines_per_min;
+  if (!shm_name) {
+    return 0;
+  }
+
+  int fd = shm_open(shm_name, O_CREAT | O_RDWR, 0644);
+  if (fd < 0) {
+    perror("trace: can't open shm");
+    return -1;
+  }
+
+  if (ftruncate(fd, TRACE_RING_SZ) < 0) {
+    perror("trace: can't resize shm");
+    close(fd);
+    return -1;
+  }
+
+  void *ptr =
+      mmap(NULL, TRACE_RING_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ptr == MAP_FAILED) {
+    perror("trace: can't mmap");
+    return -1;
+  }
+
+  struct TraceRing *ring = ptr;
+  memset(ring, 0, TRACE_RING_SZ);
+
+  struct timespec mono, real;
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  clock_gettime(CLOCK_REALTIME, &real);
+  ring->realtime_offset_ns =
+      ((int64_t)real.tv_sec - mono.tv_sec) * 1000000000ll +
+      ((int64_t)real.tv_nsec - mono.tv_nsec);
+  ring->capacity = TRACE_RING_CAPACITY;
+  ring->event_sz = sizeof(struct TraceEvent);
+  ring->version = TRACE_RING_VERSION;
+  // Publish magic last, so a reader never sees a half initialized header
+  atomic_thread_fence(memory_order_release);
+  ring->magic = TRACE_RING_MAGIC;
+
+  g_ring = ring;
+  return 0;
+}
+
+void trace_free(void) {
+  if (g_ring) {
+    munmap(g_ring, TRACE_RING_SZ);
+    g_ring = NULL;
+  }
+
+  // The ring is left in /dev/shm on purpose, so it can be inspected after
+  // shutdown (or after a crash)
+}
+
+static struct TraceEvent *trace_event_begin(enum TraceEventId id,
+                                            uint64_t *idx) {
+  struct TraceRing *ring = g_ring;
+  if (!ring) {
+    return NULL;
+  }
+
+  // Multiple threads may trace concurrently: each claims its own slot
+  *idx = atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+  struct TraceEvent *ev = &ring->events[*idx & (TRACE_RING_CAPACITY - 1)];
+  atomic_store_explicit(&ev->seq, 0, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  ev->ts_ns = time_now_ns();
+  ev->id = id;
+  return ev;
+}
+
+static void trace_event_commit(struct TraceEvent *ev, uint64_t idx) {
+  atomic_store_explicit(&ev->seq, idx + 1, memory_order_release);
+}
+
+void trace_event(enum TraceEventId id, int64_t a, int64_t b, int64_t c) {
+  uint64_t idx;
+  struct TraceEvent *ev = trace_event_begin(id, &idx);
+  if (!ev) {
+    return;
+  }
+
+  ev->payload.num[0] = a;
+  ev->payload.num[1] = b;
+  ev->payload.num[2] = c;
+  trace_event_commit(ev, idx);
+}
+
+void trace_event_str(enum TraceEventId id, const char *str) {
+  uint64_t idx;
+  struct TraceEvent *ev = trace_event_begin(id, &idx);
+  if (!ev) {
+    return;
+  }
+
+  // Keep the tail of the string, it's usually the interesting part of a path
+  const size_t len = str ? strlen(str) : 0;
+  const size_t max_len = TRACE_STR_PAYLOAD_SZ - 1;
+  const char *src = len > max_len ? str + len - max_len : str;
+  const size_t cpy_len = len > max_len ? max_len : len;
+  if (cpy_len) {
+    memcpy(ev->payload.str, src, cpy_len);
+  }
+  ev->payload.str[cpy_len] = '\0';
+  trace_event_commit(ev, idx);
+}
+
+const char *trace_event_name(uint16_t id) {
+  if (id >= TRACE_EV_COUNT) {
+    return "unknown";
+  }
+  return g_event_names[id];
+}
+
+void trace_log(FILE *fp, const char *fmt, ...) {
+  if (g_log_max_lines_per_min == 0) {
+    return;
+  }
+
+  const uint64_t now_ms = time_now_ms();
+  uint64_t window_start_ms = g_log_window_start_ms;
+  if (now_ms - window_start_ms >= 60 * 1000 &&
+      atomic_compare_exchange_strong(&g_log_window_start_ms, &window_start_ms,
+                                     now_ms)) {
+    g_log_window_lines = 0;
+    const size_t suppressed = atomic_exchange(&g_log_suppressed_lines, 0);
+    if (suppressed > 0) {
+      fprintf(fp, "(%zu log lines suppressed by rate limit)\n", suppressed);
+    }
+  }
+
+  if (atomic_fetch_add(&g_log_window_lines, 1) >= g_log_max_lines_per_min) {
+    g_log_suppressed_lines++;
+    return;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(fp, fmt, args);
+  va_end(args);
+}
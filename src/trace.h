@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Binary event trace for the hot path. Events are written to a fixed-size ring
+// in shared memory (/dev/shm/<name>) with atomics only, so tracing never blocks
+// on a slow stdout consumer and never makes a syscall. Use ambiencesvc-trace to
+// decode the ring from another process.
+//
+// All functions are safe to call before trace_init (or if it fails): events are
+// then dropped, and logging still works.
+
+#define TRACE_RING_MAGIC 0x41544352 // "RCTA"
+#define TRACE_RING_VERSION 1
+// Must be a power of 2
+#define TRACE_RING_CAPACITY 4096
+#define TRACE_STR_PAYLOAD_SZ 24
+
+enum TraceEventId {
+  TRACE_EV_NONE = 0,
+  TRACE_EV_SLIDE_REQUESTED,
+  TRACE_EV_SLIDE_RECEIVED,     // num = {img_sz, meta_sz, qr_sz}
+  TRACE_EV_META_PARSED,        // str = file path, possibly truncated
+  TRACE_EV_META_PARSE_FAILED,  // num = {meta_sz}
+  TRACE_EV_SHM_PUBLISHED,      // num = {sz, output}
+  TRACE_EV_SHM_PUBLISH_FAILED, // num = {sz, output}
+  TRACE_EV_RENDERER_NOTIFIED,  // num = {pid, output}
+  TRACE_EV_RENDERER_NOT_FOUND, // str = process name
+  TRACE_EV_RENDERER_PID_STALE, // num = {stale pid}
+  TRACE_EV_SLIDE_ALLOCS,       // num = {owned allocs, lib allocs, bytes}
+  TRACE_EV_RENDERER_NOTIFY_SKIPPED, // num = {pid, output}
+  TRACE_EV_MEMFD_PUBLISHED,    // num = {sz, output, consumers}
+  TRACE_EV_MEMFD_PUBLISH_FAILED, // num = {sz, output}
+  TRACE_EV_REVGEO_LOOKUP,      // num = {found, lookup usec}
+  TRACE_EV_POWER_CYCLE,        // num = {cpu usec, wakeups, io syscalls}
+  TRACE_EV_POWER_OVER_BUDGET,  // num = {cpu ms, wakeups per hour}
+  TRACE_EV_STAGE_MEM,          // num = {stage, peak rss kB, peak heap bytes}
+  TRACE_EV_SLIDE_MEM,          // num = {pss kB, rss kB, peak rss kB}
+  TRACE_EV_STAGE_PERF,         // num = {stage, cycles, instructions}
+  TRACE_EV_COUNT,
+};
+
+struct TraceEvent {
+  // Entry seqlock: 0 while being written, index of the event + 1 once complete
+  _Atomic uint64_t seq;
+  // CLOCK_MONOTONIC
+  uint64_t ts_ns;
+  uint16_t id;
+  uint16_t pad0;
+  uint32_t pad1;
+  union {
+    int64_t num[3];
+    char str[TRACE_STR_PAYLOAD_SZ];
+  } payload;
+};
+
+struct TraceRing {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t capacity;
+  uint32_t event_sz;
+  // Add to a monotonic timestamp to get a realtime one
+  int64_t realtime_offset_ns;
+  // Number of events ever written; the next event goes to head % capacity
+  _Atomic uint64_t head;
+  struct TraceEvent events[];
+};
+
+// Create (or reset) the trace ring in /dev/shm/shm_name. Returns 0 on success.
+// log_max_lines_per_min limits trace_log output, 0 disables it.
+int trace_init(const char *shm_name, size_t log_max_lines_per_min);
+void trace_free(void);
+
+void trace_event(enum TraceEventId id, int64_t a, int64_t b, int64_t c);
+void trace_event_str(enum TraceEventId id, const char *str);
+
+const char *trace_event_name(uint16_t id);
+
+// Rate-limited printf, for human readable messages on the hot path. Lines over
+// the limit are dropped (and counted) instead of blocking the pipeline.
+void trace_log(FILE *fp, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
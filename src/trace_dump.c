@@ -0,0 +1,234 @@
+// ambiencesvc-trace: decode the binary trace ring written by ambiencesvc
+//
+// Usage: ambiencesvc-trace [shm_name] [-f | -s]
+//   shm_name defaults to ambience_trace; -f keeps polling for new events; -s
+//   prints slide latency distributions instead of events
+
+#include "trace.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_TRACE_SHM_NAME "ambience_trace"
+#define FOLLOW_POLL_USEC (100 * 1000)
+// There can't be more slides than events in a ring of the default capacity.
+// Rings are read with the capacity they declare, so bigger ones are possible:
+// slides past this are counted as requested, but their latency is dropped.
+#define MAX_SLIDES TRACE_RING_CAPACITY
+
+// Latency of each slide in the ring, from the moment it was requested
+struct SlideLatencies {
+  // Slide received from the image service
+  uint64_t fetch_us[MAX_SLIDES];
+  size_t fetch_count;
+  // Slide published to every output
+  uint64_t publish_us[MAX_SLIDES];
+  size_t publish_count;
+  size_t requested;
+  // Current slide
+  bool in_slide;
+  uint64_t requested_ns;
+  uint64_t last_publish_ns;
+};
+
+static void slide_latencies_end_slide(struct SlideLatencies *lat) {
+  if (lat->in_slide && lat->last_publish_ns &&
+      (lat->publish_count < MAX_SLIDES)) {
+    lat->publish_us[lat->publish_count++] =
+        (lat->last_publish_ns - lat->requested_ns) / 1000;
+  }
+  lat->in_slide = false;
+}
+
+static void slide_latencies_add(struct SlideLatencies *lat,
+                                const struct TraceEvent *ev) {
+  switch (ev->id) {
+  case TRACE_EV_SLIDE_REQUESTED:
+    slide_latencies_end_slide(lat);
+    lat->in_slide = true;
+    lat->requested++;
+    lat->requested_ns = ev->ts_ns;
+    lat->last_publish_ns = 0;
+    break;
+  case TRACE_EV_SLIDE_RECEIVED:
+    if (lat->in_slide && (lat->fetch_count < MAX_SLIDES)) {
+      lat->fetch_us[lat->fetch_count++] = (ev->ts_ns - lat->requested_ns) / 1000;
+    }
+    break;
+  case TRACE_EV_SHM_PUBLISHED:
+    if (lat->in_slide) {
+      lat->last_publish_ns = ev->ts_ns;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+static int cmp_u64(const void *a, const void *b) {
+  const uint64_t va = *(const uint64_t *)a;
+  const uint64_t vb = *(const uint64_t *)b;
+  return (va > vb) - (va < vb);
+}
+
+static void print_distribution(const char *name, uint64_t *us, size_t n) {
+  if (n == 0) {
+    printf("%-22s no samples\n", name);
+    return;
+  }
+
+  qsort(us, n, sizeof(uint64_t), cmp_u64);
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    sum += us[i];
+  }
+  printf("%-22s n=%zu avg=%.1f min=%.1f p50=%.1f p90=%.1f p99=%.1f "
+         "max=%.1f ms\n",
+         name, n, sum / 1e3 / n, us[0] / 1e3, us[n / 2] / 1e3,
+         us[n * 9 / 10] / 1e3, us[n * 99 / 100] / 1e3, us[n - 1] / 1e3);
+}
+
+static void print_event(const struct TraceRing *ring, uint64_t idx,
+                        const struct TraceEvent *ev) {
+  const int64_t real_ns = (int64_t)ev->ts_ns + ring->realtime_offset_ns;
+  const time_t secs = real_ns / 1000000000ll;
+  struct tm tm;
+  localtime_r(&secs, &tm);
+  char tbuf[16];
+  strftime(tbuf, sizeof(tbuf), "%H:%M:%S", &tm);
+
+  printf("%8" PRIu64 " %s.%06" PRId64 " %-20s ", idx, tbuf,
+         (int64_t)((real_ns % 1000000000ll) / 1000), trace_event_name(ev->id));
+  switch (ev->id) {
+  case TRACE_EV_META_PARSED:
+  case TRACE_EV_RENDERER_NOT_FOUND:
+    printf("%.*s\n", TRACE_STR_PAYLOAD_SZ, ev->payload.str);
+    break;
+  default:
+    printf("%" PRId64 " %" PRId64 " %" PRId64 "\n", ev->payload.num[0],
+           ev->payload.num[1], ev->payload.num[2]);
+  }
+}
+
+// Read event idx into out. Returns false if the slot was overwritten, or is
+// being written, while we read it.
+static bool read_event(struct TraceRing *ring, uint64_t idx,
+                       struct TraceEvent *out) {
+  struct TraceEvent *ev = &ring->events[idx & (ring->capacity - 1)];
+  const uint64_t seq = atomic_load_explicit(&ev->seq, memory_order_acquire);
+  if (seq != idx + 1) {
+    return false;
+  }
+
+  out->ts_ns = ev->ts_ns;
+  out->id = ev->id;
+  memcpy(&out->payload, &ev->payload, sizeof(out->payload));
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&ev->seq, memory_order_relaxed) == seq;
+}
+
+int main(int argc, const char **argv) {
+  const char *shm_name = DEFAULT_TRACE_SHM_NAME;
+  bool follow = false;
+  bool summary = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-f") == 0) {
+      follow = true;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      summary = true;
+    } else {
+      shm_name = argv[i];
+    }
+  }
+
+  int fd = shm_open(shm_name, O_RDONLY, 0);
+  if (fd < 0) {
+    perror("ambiencesvc-trace: can't open trace shm");
+    return 1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct TraceRing)) {
+    fprintf(stderr, "ambiencesvc-trace: %s is not a trace ring\n", shm_name);
+    close(fd);
+    return 1;
+  }
+
+  struct TraceRing *ring =
+      mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    perror("ambiencesvc-trace: can't mmap");
+    return 1;
+  }
+
+  if ((ring->magic != TRACE_RING_MAGIC) ||
+      (ring->version != TRACE_RING_VERSION) ||
+      (ring->event_sz != sizeof(struct TraceEvent)) ||
+      // Used as a mask to index events
+      (ring->capacity == 0) || (ring->capacity & (ring->capacity - 1)) ||
+      (sizeof(struct TraceRing) + (size_t)ring->capacity * ring->event_sz >
+       (size_t)st.st_size)) {
+    fprintf(stderr, "ambiencesvc-trace: %s has an unknown format\n", shm_name);
+    munmap(ring, st.st_size);
+    return 1;
+  }
+
+  // Too big for the stack
+  static struct SlideLatencies lat;
+  follow &= !summary;
+  uint64_t next = 0;
+  size_t lost = 0;
+  do {
+    const uint64_t head =
+        atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (head < next) {
+      // Service restarted and reset the ring
+      next = 0;
+    }
+    if (head - next > ring->capacity) {
+      lost += head - ring->capacity - next;
+      next = head - ring->capacity;
+    }
+
+    for (; next < head; ++next) {
+      struct TraceEvent ev;
+      if (!read_event(ring, next, &ev)) {
+        lost++;
+      } else if (summary) {
+        slide_latencies_add(&lat, &ev);
+      } else {
+        print_event(ring, next, &ev);
+      }
+    }
+
+    fflush(stdout);
+    if (follow) {
+      usleep(FOLLOW_POLL_USEC);
+    }
+  } while (follow);
+
+  if (summary) {
+    slide_latencies_end_slide(&lat);
+    printf("%zu slides requested\n", lat.requested);
+    print_distribution("requested->received", lat.fetch_us, lat.fetch_count);
+    print_distribution("requested->published", lat.publish_us,
+                       lat.publish_count);
+  }
+
+  if (lost > 0) {
+    fprintf(stderr, "%zu events lost (overwritten or in flight)\n", lost);
+  }
+
+  munmap(ring, st.st_size);
+  return 0;
+}